@@ -4,6 +4,53 @@
 #include <fstream>
 #include <cmath>
 #include <tuple>
+#include <limits>
+#include <climits>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <set>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <new>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 using namespace std;
 
 // Pixel structure
@@ -16,91 +63,490 @@ struct Pixel
 };
 
 /**
- * Gets an integer from a binary stream.
- * Helper function for read_image()
- * @param stream the stream
+ * Gets an unsigned little-endian integer from a buffer holding the contents of a binary file
+ * @param data   the file contents
  * @param offset the offset at which to read the integer
- * @param bytes  the number of bytes to read
+ * @param bytes  the number of bytes to read, at most four
  * @return the integer starting at the given offset
- */ 
-int get_int(fstream& stream, int offset, int bytes)
+ */
+uint32_t get_uint32(const unsigned char data[], int offset, int bytes)
 {
-    stream.seekg(offset);
-    int result = 0;
-    int base = 1;
-    for (int i = 0; i < bytes; i++)
-    {   
-        result = result + stream.get() * base;
-        base = base * 256;
+    uint32_t result = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        result = result * 256 + data[offset + i];
     }
     return result;
 }
 
 /**
- * Reads the BMP image specified and returns the resulting image as a vector
+ * Gets an integer from a buffer holding the contents of a binary file.
+ * Helper function for decode_image()
+ * @param data   the file contents
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+int get_int(const unsigned char data[], int offset, int bytes)
+{
+    return (int)get_uint32(data, offset, bytes);
+}
+
+// BMP header fields needed to locate the pixel array
+struct BmpHeader
+{
+    uint32_t file_size;
+    // Offset of the pixel array, after the 54 header bytes
+    uint32_t start;
+    int width;
+    int height;
+    int bits_per_pixel;
+    // Bytes per scan line, including the padding to a multiple of four
+    int row_bytes;
+};
+
+/**
+ * Reads and validates the BMP header at the start of a file buffer
+ * @param data   the file contents
+ * @param size   the number of bytes in data
+ * @param header the header fields, filled in on success
+ * @return True if the header describes a pixel array that fits the file and false otherwise
+ */
+bool parse_header(const unsigned char data[], size_t size, BmpHeader& header)
+{
+    if (size < 54 || data[0] != 'B' || data[1] != 'M')
+    {
+        return false;
+    }
+
+    // Get the image properties, as the unsigned fields they are in the file
+    header.file_size = get_uint32(data, 2, 4);
+    header.start = get_uint32(data, 10, 4);
+    uint32_t width = get_uint32(data, 18, 4);
+    uint32_t height = get_uint32(data, 22, 4);
+    header.bits_per_pixel = get_int(data, 28, 2);
+
+    // Only uncompressed 24 and 32 bit bottom-up images are supported, with the pixel array after
+    // the header. A negative height (a top-down image) reads as over INT_MAX here.
+    if (header.start < 54 || width == 0 || height == 0 || width > INT_MAX || height > INT_MAX
+        || (header.bits_per_pixel != 24 && header.bits_per_pixel != 32))
+    {
+        return false;
+    }
+    header.width = width;
+    header.height = height;
+
+    // Scan lines occupy multiples of four bytes
+    uint64_t row_bytes = ((uint64_t)width * (header.bits_per_pixel / 8) + 3) & ~(uint64_t)3;
+    if (row_bytes > INT_MAX)
+    {
+        return false;
+    }
+    header.row_bytes = (int)row_bytes;
+
+    // Reject the image if the pixel array does not match the file. In 64 bits, so no field can
+    // wrap the sum round to a small size.
+    uint64_t end = (uint64_t)header.start + row_bytes * height;
+    return end == header.file_size && end <= size;
+}
+
+/**
+ * Reads just the header of a BMP file, to learn its size without reading the pixels
  * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * @param header   the header fields, filled in on success
+ * @return True if the file is a valid BMP image and false otherwise
  */
-vector<vector<Pixel>> read_image(string filename)
+bool probe_image(string filename, BmpHeader& header)
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
+    ifstream stream(filename, ios::in | ios::binary);
+    unsigned char data[54];
+    if (!stream.read((char*)data, sizeof(data)))
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    streamoff size = stream.tellg();
+    return size > 0 && parse_header(data, size, header);
+}
+
+// Running 64-bit content hash of pixel data (the XXH64 algorithm). Pixel data is hashed as
+// packed blue, green, red bytes from the top row to the bottom, so an image hashes the same
+// whether it came from a file, from memory or from a file with different row padding.
+struct PixelHash
+{
+    // Four independent lanes so consecutive 8 byte words do not wait on each other
+    uint64_t lanes[4];
+    unsigned char pending[32];
+    size_t pending_size;
+    uint64_t total;
+    uint64_t seed;
+};
+
+const uint64_t HASH_PRIME_1 = 11400714785074694791ULL;
+const uint64_t HASH_PRIME_2 = 14029467366897019727ULL;
+const uint64_t HASH_PRIME_3 = 1609587929392839161ULL;
+const uint64_t HASH_PRIME_4 = 9650029242287828579ULL;
+const uint64_t HASH_PRIME_5 = 2870177450012600261ULL;
+
+inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t load64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc = acc + input * HASH_PRIME_2;
+    acc = rotl64(acc, 31);
+    return acc * HASH_PRIME_1;
+}
+
+inline uint64_t hash_merge(uint64_t acc, uint64_t lane)
+{
+    acc = acc ^ hash_round(0, lane);
+    return acc * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+/**
+ * Starts hashing the pixel data of an image
+ * @param hash   the hash state
+ * @param width  the image width, mixed into the hash
+ * @param height the image height, mixed into the hash
+ * @return nothing
+ */
+void hash_start(PixelHash& hash, int width, int height)
+{
+    hash.seed = ((uint64_t)(uint32_t)width << 32) | (uint32_t)height;
+    hash.lanes[0] = hash.seed + HASH_PRIME_1 + HASH_PRIME_2;
+    hash.lanes[1] = hash.seed + HASH_PRIME_2;
+    hash.lanes[2] = hash.seed;
+    hash.lanes[3] = hash.seed - HASH_PRIME_1;
+    hash.pending_size = 0;
+    hash.total = 0;
+}
+
+/**
+ * Adds bytes to the hash
+ * @param hash the hash state
+ * @param data the bytes to add
+ * @param size the number of bytes
+ * @return nothing
+ */
+void hash_update(PixelHash& hash, const unsigned char data[], size_t size)
+{
+    hash.total = hash.total + size;
+    if (hash.pending_size > 0)
+    {
+        size_t take = min(size, 32 - hash.pending_size);
+        memcpy(hash.pending + hash.pending_size, data, take);
+        hash.pending_size = hash.pending_size + take;
+        data = data + take;
+        size = size - take;
+        if (hash.pending_size < 32)
+        {
+            return;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            hash.lanes[i] = hash_round(hash.lanes[i], load64(hash.pending + 8 * i));
+        }
+        hash.pending_size = 0;
+    }
+
+    uint64_t v1 = hash.lanes[0], v2 = hash.lanes[1], v3 = hash.lanes[2], v4 = hash.lanes[3];
+    while (size >= 32)
+    {
+        v1 = hash_round(v1, load64(data));
+        v2 = hash_round(v2, load64(data + 8));
+        v3 = hash_round(v3, load64(data + 16));
+        v4 = hash_round(v4, load64(data + 24));
+        data = data + 32;
+        size = size - 32;
+    }
+    hash.lanes[0] = v1;
+    hash.lanes[1] = v2;
+    hash.lanes[2] = v3;
+    hash.lanes[3] = v4;
 
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
+    memcpy(hash.pending, data, size);
+    hash.pending_size = size;
+}
 
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
+/**
+ * Finishes the hash
+ * @param hash the hash state
+ * @return the 64-bit hash of everything added since hash_start()
+ */
+uint64_t hash_finish(const PixelHash& hash)
+{
+    uint64_t h;
+    if (hash.total >= 32)
+    {
+        h = rotl64(hash.lanes[0], 1) + rotl64(hash.lanes[1], 7)
+            + rotl64(hash.lanes[2], 12) + rotl64(hash.lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            h = hash_merge(h, hash.lanes[i]);
+        }
+    }
+    else
     {
-        padding = 4 - scanline_size % 4;
+        h = hash.seed + HASH_PRIME_5;
     }
+    h = h + hash.total;
 
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+    const unsigned char* p = hash.pending;
+    size_t size = hash.pending_size;
+    while (size >= 8)
     {
-        return {};
+        h = h ^ hash_round(0, load64(p));
+        h = rotl64(h, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+        p = p + 8;
+        size = size - 8;
+    }
+    if (size >= 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h = h ^ ((uint64_t)v * HASH_PRIME_1);
+        h = rotl64(h, 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        p = p + 4;
+        size = size - 4;
+    }
+    while (size > 0)
+    {
+        h = h ^ (*p * HASH_PRIME_5);
+        h = rotl64(h, 11) * HASH_PRIME_1;
+        p++;
+        size--;
     }
 
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+    h = h ^ (h >> 33);
+    h = h * HASH_PRIME_2;
+    h = h ^ (h >> 29);
+    h = h * HASH_PRIME_3;
+    h = h ^ (h >> 32);
+    return h;
+}
 
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+/**
+ * Hashes the pixel data of an image held in memory
+ * @param image the image
+ * @return the same hash read_image() computes while decoding the image from a file
+ */
+uint64_t hash_image(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = height > 0 ? image[0].size() : 0;
+    PixelHash hash;
+    hash_start(hash, width, height);
+    vector<unsigned char> row_bytes(width * 3);
+    for (int i = 0; i < height; i++)
     {
-        // For each column
+        unsigned char* dst = row_bytes.data();
         for (int j = 0; j < width; j++)
         {
-            // Go to the pixel position
-            stream.seekg(pos);
+            dst[0] = image[i][j].blue;
+            dst[1] = image[i][j].green;
+            dst[2] = image[i][j].red;
+            dst = dst + 3;
+        }
+        hash_update(hash, row_bytes.data(), row_bytes.size());
+    }
+    return hash_finish(hash);
+}
 
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
+string hash_to_string(uint64_t hash)
+{
+    const char digits[] = "0123456789abcdef";
+    string text(16, '0');
+    for (int i = 15; i >= 0; i--)
+    {
+        text[i] = digits[hash & 15];
+        hash = hash >> 4;
+    }
+    return text;
+}
+
+/**
+ * Makes the image the given size, keeping its storage if it already is that size
+ * @param image the image to size
+ * @param rows  the number of rows
+ * @param cols  the number of columns
+ * @return nothing
+ */
+void size_image_to(vector<vector<Pixel>>& image, int rows, int cols)
+{
+    if ((int)image.size() != rows || (rows > 0 && (int)image[0].size() != cols))
+    {
+        image.assign(rows, vector<Pixel> (cols));
+    }
+}
 
+/**
+ * Decodes the pixel array of a BMP file held in memory whose header was already validated
+ * @param data   the file contents
+ * @param header the header fields returned by parse_header()
+ * @param image  the decoded image, reusing its storage when the size is unchanged
+ * @param hash   if not NULL, set to the hash_image() of the decoded image
+ * @return nothing
+ */
+void decode_pixels(const unsigned char data[], const BmpHeader& header, vector<vector<Pixel>>& image,
+                   uint64_t* hash = NULL)
+{
+    size_image_to(image, header.height, header.width);
+
+    PixelHash row_hash;
+    hash_start(row_hash, header.width, header.height);
+    unsigned char packed[3 * 64];
+
+    int bytes_per_pixel = header.bits_per_pixel / 8;
+    // For each row, reading its scan line from the end of the pixel array
+    // Note: BMP files store pixels from bottom to top
+    for (int i = 0; i < header.height; i++)
+    {
+        const unsigned char* scanline = data + header.start + (size_t)(header.height - 1 - i) * header.row_bytes;
+        const unsigned char* src = scanline;
+        Pixel* row = image[i].data();
+        for (int j = 0; j < header.width; j++)
+        {
+            // Note: BMP files store pixels in blue, green, red order
             // We are ignoring the alpha channel if there is one
+            row[j].blue = src[0];
+            row[j].green = src[1];
+            row[j].red = src[2];
+            src = src + bytes_per_pixel;
+        }
 
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
+        // Hash the scan line while it is still in cache
+        if (hash == NULL)
+        {
+            continue;
+        }
+        if (bytes_per_pixel == 3)
+        {
+            hash_update(row_hash, scanline, header.width * 3);
+            continue;
         }
+        for (int j = 0; j < header.width; j = j + 64)
+        {
+            int count = min(64, header.width - j);
+            for (int k = 0; k < count; k++)
+            {
+                memcpy(packed + 3 * k, scanline + (j + k) * bytes_per_pixel, 3);
+            }
+            hash_update(row_hash, packed, count * 3);
+        }
+    }
+    if (hash != NULL)
+    {
+        *hash = hash_finish(row_hash);
+    }
+}
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
+/**
+ * Decodes a BMP file held in memory
+ * @param data  the file contents
+ * @param size  the number of bytes in data
+ * @param image the decoded image, reusing its storage when the size is unchanged
+ * @param hash  if not NULL, set to the hash_image() of the decoded image
+ * @return True if successful and false otherwise
+ */
+bool decode_image(const unsigned char data[], size_t size, vector<vector<Pixel>>& image,
+                  uint64_t* hash = NULL)
+{
+    BmpHeader header;
+    if (!parse_header(data, size, header))
+    {
+        return false;
     }
+    decode_pixels(data, header, image, hash);
+    return true;
+}
 
-    // Close the stream and return the image vector
-    stream.close();
+/**
+ * Reads a whole file into a buffer
+ * @param filename the file to read
+ * @param buffer   the file contents, reusing its storage between calls
+ * @return True if successful and false otherwise
+ */
+bool read_file(string filename, vector<unsigned char>& buffer)
+{
+    ifstream stream(filename, ios::in | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.seekg(0, ios::end);
+    streamoff size = stream.tellg();
+    if (size < 0)
+    {
+        return false;
+    }
+    stream.seekg(0, ios::beg);
+    buffer.resize(size);
+    stream.read((char*)buffer.data(), size);
+    return stream.gcount() == size;
+}
+
+/**
+ * Names the temporary file an output is written to before it is renamed into place. The name
+ * holds the host and process, so processes sharing an output directory, on one machine or over
+ * a network file system, never write the same temporary file.
+ * @param filename the output file
+ * @return the temporary file, next to the output
+ */
+string temp_name(string filename)
+{
+    // The process id is looked up each time, as forked children share the host name
+    static const string host = []
+    {
+        char name[256] = "";
+        gethostname(name, sizeof(name) - 1);
+        return string(name);
+    }();
+    return filename + "." + host + "." + to_string(getpid()) + ".part";
+}
+
+/**
+ * Reads the BMP image specified into an existing image
+ * @param filename BMP image filename
+ * @param image    the image, reusing its storage when the size is unchanged
+ * @param buffer   scratch space for the file contents, reused between calls
+ * @param hash     if not NULL, set to the hash_image() of the image, computed while decoding
+ * @return True if successful and false otherwise
+ */
+bool read_image(string filename, vector<vector<Pixel>>& image, vector<unsigned char>& buffer,
+                uint64_t* hash = NULL)
+{
+    if (!read_file(filename, buffer))
+    {
+        return false;
+    }
+    return decode_image(buffer.data(), buffer.size(), image, hash);
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image as a vector
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> read_image(string filename)
+{
+    vector<unsigned char> buffer;
+    vector<vector<Pixel>> image;
+
+    // Return empty vector if this is not a valid image
+    if (!read_image(filename, image, buffer))
+    {
+        return {};
+    }
     return image;
 }
 
@@ -122,47 +568,52 @@ void set_bytes(unsigned char arr[], int offset, int bytes, int value)
     }
 }
 
+// Sizes of the two headers before the pixel array of the BMP files written here
+const int BMP_HEADER_SIZE = 14;
+const int DIB_HEADER_SIZE = 40;
+
 /**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
+ * Checks that a 24 bit image can be written as a BMP file, whose size field is 32 bits
+ * @param width_pixels  The image width in pixels
+ * @param height_pixels The image height in pixels
+ * @return True if the whole file fits the size field and false otherwise
  */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+bool bmp_fits(long long width_pixels, long long height_pixels)
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
+    if (width_pixels < 1 || height_pixels < 1 || width_pixels > INT_MAX || height_pixels > INT_MAX)
+    {
+        return false;
+    }
+    uint64_t row_bytes = ((uint64_t)width_pixels * 3 + 3) & ~(uint64_t)3;
+    return BMP_HEADER_SIZE + DIB_HEADER_SIZE + row_bytes * height_pixels <= UINT32_MAX;
+}
 
+/**
+ * Fills in the BMP and DIB headers of a 24 bit BMP file, for an image that passes bmp_fits()
+ * @param header        The first BMP_HEADER_SIZE + DIB_HEADER_SIZE bytes of the file
+ * @param width_pixels  The image width in pixels
+ * @param height_pixels The image height in pixels
+ * @return the number of bytes in each row of the pixel array, including padding
+ */
+int set_bmp_headers(unsigned char header[], int width_pixels, int height_pixels)
+{
     // Calculate the width in bytes incorporating padding (4 byte alignment)
     int width_bytes = width_pixels * 3;
     int padding_bytes = 0;
     padding_bytes = (4 - width_bytes % 4) % 4;
     width_bytes = width_bytes + padding_bytes;
 
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
-
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
-
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
-    {
-        return false;
-    }
+    // Pixel array size in bytes, including padding; up to 4 GB, so the size fields are
+    // written from its unsigned bits
+    uint32_t array_bytes = (uint64_t)width_bytes * height_pixels;
 
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
+    unsigned char* bmp_header = header;
+    unsigned char* dib_header = header + BMP_HEADER_SIZE;
 
     // BMP Header
     set_bytes(bmp_header,  0, 1, 'B');              // ID field
     set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
+    set_bytes(bmp_header,  2, 4, (int)(BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes)); // Size of BMP file
     set_bytes(bmp_header,  6, 2, 0);                // Reserved
     set_bytes(bmp_header,  8, 2, 0);                // Reserved
     set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
@@ -174,54 +625,237 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
     set_bytes(dib_header, 12, 2, 1);                // Number of color planes
     set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
     set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
+    set_bytes(dib_header, 20, 4, (int)array_bytes); // Size of raw bitmap data (including padding)
     set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
     set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
     set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
     set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+    return width_bytes;
+}
 
-    // Write the BMP and DIB Headers to the file
-    stream.write((char*)bmp_header, sizeof(bmp_header));
-    stream.write((char*)dib_header, sizeof(dib_header));
+/**
+ * Encodes the input image as a 24 bit BMP file in memory
+ * @param image  The input image to encode
+ * @param buffer The file contents, reusing its storage between calls
+ * @return nothing
+ */
+void encode_image(const vector<vector<Pixel>>& image, vector<unsigned char>& buffer)
+{
+    // Get the image width and height in pixels
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+    int width_bytes = width_pixels * 3;
+    int padding_bytes = (4 - width_bytes % 4) % 4;
 
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
+    // Create the BMP and DIB Headers
+    buffer.resize(BMP_HEADER_SIZE + DIB_HEADER_SIZE + (size_t)(width_bytes + padding_bytes) * height_pixels);
+    set_bmp_headers(buffer.data(), width_pixels, height_pixels);
 
     // Pixel Array (Left to right, bottom to top, with padding)
+    unsigned char* dst = buffer.data() + BMP_HEADER_SIZE + DIB_HEADER_SIZE;
     for (int h = height_pixels - 1; h >= 0; h--)
     {
+        const Pixel* row = image[h].data();
         for (int w = 0; w < width_pixels; w++)
         {
             // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
+            dst[0] = row[w].blue;
+            dst[1] = row[w].green;
+            dst[2] = row[w].red;
+            dst = dst + 3;
         }
         // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
+        for (int p = 0; p < padding_bytes; p++)
+        {
+            *dst++ = 0;
+        }
     }
-
-    // Close the stream and return true
-    stream.close();
-    return true;
 }
 
-typedef vector<vector<Pixel>> Image;
-typedef Image (*Process)(const Image&);
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param buffer   Scratch space for the file contents, reused between calls
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const vector<vector<Pixel>>& image, vector<unsigned char>& buffer)
+{
+    // Open a file stream for writing to a binary file
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
 
-//**************************************************************************************************//
-//                                       Processing Helpers                                         //
-//**************************************************************************************************//
+    // If there was a problem opening the file, return false
+    if (!stream.is_open())
+    {
+        return false;
+    }
 
-std::tuple<int, int> size_image(const Image& image) {
-    int rows = image.size();
-    int cols = image[0].size();
-    return std::make_tuple(rows, cols);
+    encode_image(image, buffer);
+    stream.write((char*)buffer.data(), buffer.size());
+
+    // Close the stream and return true
+    stream.close();
+    return !stream.fail();
 }
 
-std::tuple<int,int,int> rbg_pixel(Pixel p) {
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const vector<vector<Pixel>>& image)
+{
+    vector<unsigned char> buffer;
+    return write_image(filename, image, buffer);
+}
+
+/**
+ * Reads the next number from a PPM header, skipping whitespace and comments
+ * @param data  the file contents
+ * @param size  the number of bytes in data
+ * @param pos   the offset to start at, moved past the number
+ * @param value the number read
+ * @return True if a number was found and false otherwise
+ */
+bool ppm_number(const unsigned char data[], size_t size, size_t& pos, int& value)
+{
+    while (pos < size && (isspace(data[pos]) || data[pos] == '#'))
+    {
+        if (data[pos] == '#')
+        {
+            while (pos < size && data[pos] != '\n')
+            {
+                pos++;
+            }
+        }
+        else
+        {
+            pos++;
+        }
+    }
+    if (pos >= size || !isdigit(data[pos]))
+    {
+        return false;
+    }
+    value = 0;
+    while (pos < size && isdigit(data[pos]) && value < 1000000)
+    {
+        value = value * 10 + (data[pos] - '0');
+        pos++;
+    }
+    return true;
+}
+
+/**
+ * Decodes a binary (P6) PPM file held in memory
+ * @param data  the file contents
+ * @param size  the number of bytes in data
+ * @param image the decoded image, reusing its storage when the size is unchanged
+ * @return True if successful and false otherwise
+ */
+bool decode_ppm(const unsigned char data[], size_t size, vector<vector<Pixel>>& image)
+{
+    size_t pos = 2;
+    int width, height, max_value;
+    if (size < 2 || data[0] != 'P' || data[1] != '6'
+        || !ppm_number(data, size, pos, width) || !ppm_number(data, size, pos, height)
+        || !ppm_number(data, size, pos, max_value))
+    {
+        return false;
+    }
+    // A single whitespace character separates the header from the samples
+    pos++;
+    if (width <= 0 || height <= 0 || max_value <= 0 || max_value > 255
+        || pos > size || (size - pos) / 3 / width < (size_t)height)
+    {
+        return false;
+    }
+    size_image_to(image, height, width);
+    const unsigned char* src = data + pos;
+    for (int h = 0; h < height; h++)
+    {
+        Pixel* row = image[h].data();
+        for (int w = 0; w < width; w++)
+        {
+            row[w].red = src[0] * 255 / max_value;
+            row[w].green = src[1] * 255 / max_value;
+            row[w].blue = src[2] * 255 / max_value;
+            src = src + 3;
+        }
+    }
+    return true;
+}
+
+/**
+ * Encodes the input image as a binary (P6) PPM file in memory
+ * @param image  The input image to encode
+ * @param buffer The file contents, reusing its storage between calls
+ * @return nothing
+ */
+void encode_ppm(const vector<vector<Pixel>>& image, vector<unsigned char>& buffer)
+{
+    int width = image[0].size();
+    int height = image.size();
+    string header = "P6\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+    buffer.resize(header.size() + (size_t)width * height * 3);
+    memcpy(buffer.data(), header.data(), header.size());
+    unsigned char* dst = buffer.data() + header.size();
+    for (int h = 0; h < height; h++)
+    {
+        const Pixel* row = image[h].data();
+        for (int w = 0; w < width; w++)
+        {
+            dst[0] = row[w].red;
+            dst[1] = row[w].green;
+            dst[2] = row[w].blue;
+            dst = dst + 3;
+        }
+    }
+}
+
+typedef vector<vector<Pixel>> Image;
+typedef Image (*Process)(const Image&);
+
+// Settings for one filter, gathered once so the filter can be re-run without prompting
+struct FilterSpec
+{
+    // Menu selection of the filter (1-10)
+    int selection;
+    // Scaling factor for clarendon, lighten and darken
+    double scale;
+    // Number of 90 degree rotations
+    int rotations;
+    // Enlarge factors
+    int x_scale;
+    int y_scale;
+};
+
+// Tables derived from a FilterSpec, built once and shared by every image the filter runs on
+struct FilterState
+{
+    FilterSpec spec;
+    // Channel value -> lightened / darkened channel value
+    int lut_light[256];
+    int lut_dark[256];
+    // Vignette scale factor of each pixel, rebuilt only when the image size changes
+    int mask_rows;
+    int mask_cols;
+    vector<double> mask;
+};
+
+//**************************************************************************************************//
+//                                       Processing Helpers                                         //
+//**************************************************************************************************//
+
+std::tuple<int, int> size_image(const Image& image) {
+    int rows = image.size();
+    int cols = image[0].size();
+    return std::make_tuple(rows, cols);
+}
+
+std::tuple<int,int,int> rbg_pixel(Pixel p) {
     return std::make_tuple(p.red, p.blue, p.green);
 }
 
@@ -245,397 +879,6900 @@ double get_scale() {
             cout << "Invalid input! Please enter an integer > 0" << endl;
         }
     }
-    return scale;
+    return scale;
+}
+
+int get_positive_int(string prompt) {
+    int num = 0;
+    while (num < 1 || cin.fail()) {
+        cin.clear();
+        cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        cout << prompt;
+        cin >> num;
+        cout << endl;
+        if (num < 1 || cin.fail()) {
+            cout << "Invalid input! Please enter an integer > 0" << endl;
+        }
+    }
+    return num;
+}
+
+FilterSpec new_spec(int selection) {
+    FilterSpec spec = FilterSpec();
+    spec.selection = selection;
+    spec.scale = 1.0;
+    spec.rotations = selection == 4 ? 1 : 0;
+    spec.x_scale = 1;
+    spec.y_scale = 1;
+    return spec;
+}
+
+/**
+ * Asks the user for whatever settings the selected filter needs
+ * @param selection The menu selection of the filter (1-10)
+ * @return the filter settings
+ */
+FilterSpec get_filter_spec(int selection) {
+    FilterSpec spec = new_spec(selection);
+    if (selection == 2 || selection == 8 || selection == 9) {
+        spec.scale = get_scale();
+    } else if (selection == 5) {
+        spec.rotations = get_positive_int("Enter number of 90 degree rotations: ");
+    } else if (selection == 6) {
+        spec.x_scale = get_positive_int("Enter X scale: ");
+        spec.y_scale = get_positive_int("Enter Y scale: ");
+    }
+    return spec;
+}
+
+// Short names for each filter, used on the command line and in output file names
+const string spec_names[10] = {
+        "vignette",
+        "clarendon",
+        "greyscale",
+        "rotate90",
+        "rotate",
+        "enlarge",
+        "contrast",
+        "lighten",
+        "darken",
+        "colors"
+};
+
+// Largest x_scale * y_scale of an enlargement, so one filter cannot ask for more memory than
+// any machine has
+const long long ENLARGE_MAX_FACTOR = 4096;
+
+/**
+ * Reads filter settings written as NAME or NAME:VALUE, such as greyscale, lighten:0.5, rotate:3
+ * or enlarge:2x3. NAME may also be the menu number. A missing value means a scale of 0.5, one
+ * rotation or an enlargement of 2x2.
+ * @param text The filter settings
+ * @param spec Set to the filter settings on success
+ * @return True if the text names a filter with valid settings and false otherwise
+ */
+bool parse_filter_spec(string text, FilterSpec& spec) {
+    size_t colon = text.find(':');
+    string name = text.substr(0, colon);
+    string value = colon == string::npos ? "" : text.substr(colon + 1);
+    int selection = atoi(name.c_str());
+    for (int i = 0; i < 10; i++) {
+        if (name == spec_names[i]) {
+            selection = i + 1;
+        }
+    }
+    if (selection < 1 || selection > 10) {
+        return false;
+    }
+    spec = new_spec(selection);
+    if (selection == 2 || selection == 8 || selection == 9) {
+        spec.scale = value.empty() ? 0.5 : atof(value.c_str());
+        return spec.scale > 0.0 && spec.scale <= 1.0;
+    } else if (selection == 5) {
+        spec.rotations = value.empty() ? 1 : atoi(value.c_str());
+        return spec.rotations >= 0;
+    } else if (selection == 6) {
+        if (!value.empty()) {
+            size_t x = value.find('x');
+            spec.x_scale = atoi(value.substr(0, x).c_str());
+            spec.y_scale = x == string::npos ? spec.x_scale : atoi(value.substr(x + 1).c_str());
+        } else {
+            spec.x_scale = 2;
+            spec.y_scale = 2;
+        }
+        return spec.x_scale >= 1 && spec.y_scale >= 1
+            && (long long)spec.x_scale * spec.y_scale <= ENLARGE_MAX_FACTOR;
+    }
+    return value.empty();
+}
+
+// Names the filter and its settings in a form usable in a file name, such as lighten_0.5
+string spec_label(const FilterSpec& spec) {
+    string label = spec_names[spec.selection - 1];
+    if (spec.selection == 2 || spec.selection == 8 || spec.selection == 9) {
+        ostringstream value;
+        value << spec.scale;
+        label = label + "_" + value.str();
+    } else if (spec.selection == 5) {
+        label = label + "_" + to_string(spec.rotations);
+    } else if (spec.selection == 6) {
+        label = label + "_" + to_string(spec.x_scale) + "x" + to_string(spec.y_scale);
+    }
+    return label;
+}
+
+FilterState new_state(const FilterSpec& spec) {
+    FilterState state = FilterState();
+    state.spec = spec;
+    for (int v = 0; v < 256; v++) {
+        state.lut_light[v] = 255 - ((255 - v) * spec.scale);
+        state.lut_dark[v] = v * spec.scale;
+    }
+    state.mask_rows = 0;
+    state.mask_cols = 0;
+    return state;
+}
+
+// Channel values outside 0-255 only come from chaining filters, so they skip the tables
+int lighten_value(const FilterState& state, int v) {
+    if (v >= 0 && v < 256) {
+        return state.lut_light[v];
+    }
+    return 255 - ((255 - v) * state.spec.scale);
+}
+
+int darken_value(const FilterState& state, int v) {
+    if (v >= 0 && v < 256) {
+        return state.lut_dark[v];
+    }
+    return v * state.spec.scale;
+}
+
+//**************************************************************************************************//
+//                                        Tiled Executor                                            //
+//**************************************************************************************************//
+
+// Engine settings, which the profile written by the autotune command can change
+// Side length in pixels of the square tiles point-wise filters are run over
+int tile_size = 64;
+// How quarter turns are copied: ROTATE_BLOCKED in square blocks of rotate_block pixels, or
+// ROTATE_RECURSIVE by halving the image until the pieces fit in whatever caches there are
+const int ROTATE_BLOCKED = 0;
+const int ROTATE_RECURSIVE = 1;
+int rotate_kernel = ROTATE_RECURSIVE;
+// Side length of the blocks ROTATE_BLOCKED copies, small enough that the block's input rows and
+// output rows all stay in the L1 cache
+int rotate_block = 32;
+// Rows each sweep worker filters and writes at a time
+int band_rows = 32;
+// Worker threads for the tiled executor, 0 to use every core
+int thread_count = 0;
+// Worker threads for images filtered on this thread, set by the batch runner when it runs
+// several images at once; 0 to use thread_count
+thread_local int image_threads = 0;
+// Images smaller than this many pixels are filtered on the calling thread
+const long long PARALLEL_MIN_PIXELS = 1 << 18;
+// Outputs at least this many bytes are written with non-temporal stores that bypass the cache,
+// since they would only push the input out of it
+size_t streaming_store_bytes = 32 << 20;
+// The profile the settings were loaded from, empty if they are the defaults
+string engine_profile;
+
+// Counters describing the work the engine has done, shown in the reports
+struct EngineStats
+{
+    atomic<long long> tiles;
+    atomic<long long> uniform_tiles;
+    atomic<long long> pixels;
+    atomic<long long> skipped_pixels;
+};
+
+EngineStats engine_stats;
+
+void reset_engine_stats() {
+    engine_stats.tiles = 0;
+    engine_stats.uniform_tiles = 0;
+    engine_stats.pixels = 0;
+    engine_stats.skipped_pixels = 0;
+}
+
+// Describes the engine settings in one line
+string engine_settings() {
+    ostringstream out;
+    out << "tile " << tile_size << ", rotate "
+        << (rotate_kernel == ROTATE_RECURSIVE ? string("recursive") : "block " + to_string(rotate_block)) << ", band " << band_rows << " rows, "
+        << (thread_count > 0 ? to_string(thread_count) : "all") << " threads, streaming stores "
+        << (streaming_store_bytes == numeric_limits<size_t>::max() ? string("off")
+            : "from " + to_string(streaming_store_bytes >> 20) + " MB")
+        << (engine_profile.empty() ? "" : " (" + engine_profile + ")");
+    return out.str();
+}
+
+void print_engine_stats() {
+    cout << "Engine: " << engine_settings() << endl;
+    long long tiles = engine_stats.tiles;
+    if (tiles == 0) {
+        return;
+    }
+    long long pixels = engine_stats.pixels;
+    long long skipped = engine_stats.skipped_pixels;
+    cout << "Uniform tiles: " << engine_stats.uniform_tiles << " of " << tiles << " ("
+         << (pixels > 0 ? 100.0 * skipped / pixels : 0.0) << "% of pixels computed once per tile)" << endl;
+}
+
+// Cooperative cancellation of a job, checked by the engine between tiles
+struct CancelToken
+{
+    atomic<bool> cancelled;
+    // A job still running at its deadline is abandoned
+    bool has_deadline;
+    chrono::steady_clock::time_point deadline;
+};
+
+// The job the calling thread is running, set by the job scheduler; NULL outside of jobs
+thread_local CancelToken* current_job = NULL;
+// Called between tiles on the thread that started a job, so the job scheduler can run more
+// urgent work first
+thread_local void (*tile_checkpoint)() = NULL;
+
+bool job_cancelled(const CancelToken* token) {
+    return token != NULL && (token->cancelled.load(memory_order_relaxed)
+        || (token->has_deadline && chrono::steady_clock::now() >= token->deadline));
+}
+
+/**
+ * Called by the engine before each tile of work
+ * @param token The job the work belongs to, or NULL
+ * @param owner True on the thread that started the job, false on helper threads
+ * @return True if the job has been cancelled and the rest of its tiles should be skipped
+ */
+bool between_tiles(const CancelToken* token, bool owner) {
+    if (owner && tile_checkpoint != NULL) {
+        tile_checkpoint();
+    }
+    return job_cancelled(token);
+}
+
+int worker_count() {
+    if (image_threads > 0) {
+        return image_threads;
+    }
+    if (thread_count > 0) {
+        return thread_count;
+    }
+    int cores = thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+/**
+ * Copies bytes with non-temporal stores where the CPU has them, so the destination is not pulled
+ * into the cache. stream_fence() must be called before another thread reads the destination.
+ * @param dst The destination
+ * @param src The source
+ * @param bytes The number of bytes to copy
+ * @return nothing
+ */
+void stream_copy(void* dst, const void* src, size_t bytes) {
+#if defined(__SSE2__)
+    unsigned char* d = (unsigned char*)dst;
+    const unsigned char* s = (const unsigned char*)src;
+    // Streaming stores need 16 byte aligned destinations
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+    if (head > bytes) {
+        head = bytes;
+    }
+    memcpy(d, s, head);
+    d = d + head;
+    s = s + head;
+    bytes = bytes - head;
+    for (; bytes >= 64; bytes = bytes - 64, d = d + 64, s = s + 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_stream_si128((__m128i*)d, a);
+        _mm_stream_si128((__m128i*)(d + 16), b);
+        _mm_stream_si128((__m128i*)(d + 32), c);
+        _mm_stream_si128((__m128i*)(d + 48), e);
+    }
+    for (; bytes >= 16; bytes = bytes - 16, d = d + 16, s = s + 16) {
+        _mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+    }
+    memcpy(d, s, bytes);
+#else
+    memcpy(dst, src, bytes);
+#endif
+}
+
+// Orders this thread's streaming stores before anything it does next
+void stream_fence() {
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+bool same_pixel(const Pixel& a, const Pixel& b) {
+    return a.red == b.red && a.green == b.green && a.blue == b.blue;
+}
+
+/**
+ * Checks whether every pixel of a tile has the same color
+ * @param image The image
+ * @param top, left The first row and column of the tile
+ * @param bottom, right One past the last row and column of the tile
+ * @return True if the tile is a single color and false otherwise
+ */
+bool uniform_tile(const Image& image, int top, int left, int bottom, int right) {
+    const Pixel first = image[top][left];
+    for (int row = top; row < bottom; row++) {
+        const Pixel* src = image[row].data();
+        for (int col = left; col < right; col++) {
+            if (!same_pixel(src[col], first)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Applies a point-wise pixel function to every pixel of the image, one tile at a time. A tile
+ * whose pixels all share one color has its output computed from a single pixel and filled in.
+ * Large images are split across worker threads.
+ * @param image The input image
+ * @param new_image The output image, the same size as the input
+ * @param op A function taking a Pixel and returning the filtered Pixel
+ * @return nothing
+ */
+template <typename Op>
+void map_pixels(const Image& image, Image& new_image, Op op) {
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    size_image_to(new_image, rows, cols);
+    int tiles_across = (cols + tile_size - 1) / tile_size;
+    int tiles_down = (rows + tile_size - 1) / tile_size;
+    int tile_total = tiles_across * tiles_down;
+    atomic<int> next_tile(0);
+    bool streaming = (size_t)rows * cols * sizeof(Pixel) >= streaming_store_bytes;
+    CancelToken* token = current_job;
+
+    auto worker = [&](bool owner) {
+        long long uniform = 0, skipped = 0;
+        // Large outputs are built a tile row at a time here, then streamed out
+        vector<Pixel> staging(streaming ? tile_size : 0);
+        for (int t = next_tile++; t < tile_total; t = next_tile++) {
+            if (between_tiles(token, owner)) {
+                break;
+            }
+            int top = (t / tiles_across) * tile_size;
+            int left = (t % tiles_across) * tile_size;
+            int bottom = min(top + tile_size, rows);
+            int right = min(left + tile_size, cols);
+            size_t row_bytes = (right - left) * sizeof(Pixel);
+            if (uniform_tile(image, top, left, bottom, right)) {
+                Pixel p = op(image[top][left]);
+                if (streaming) {
+                    fill(staging.begin(), staging.begin() + (right - left), p);
+                }
+                for (int row = top; row < bottom; row++) {
+                    if (streaming) {
+                        stream_copy(new_image[row].data() + left, staging.data(), row_bytes);
+                    } else {
+                        fill(new_image[row].begin() + left, new_image[row].begin() + right, p);
+                    }
+                }
+                uniform++;
+                skipped += (long long)(bottom - top) * (right - left);
+                continue;
+            }
+            for (int row = top; row < bottom; row++) {
+                const Pixel* src = image[row].data();
+                Pixel* dst = streaming ? staging.data() : new_image[row].data() + left;
+                for (int col = left; col < right; col++) {
+                    dst[col - left] = op(src[col]);
+                }
+                if (streaming) {
+                    stream_copy(new_image[row].data() + left, staging.data(), row_bytes);
+                }
+            }
+        }
+        if (streaming) {
+            stream_fence();
+        }
+        engine_stats.uniform_tiles += uniform;
+        engine_stats.skipped_pixels += skipped;
+    };
+
+    int workers = (long long)rows * cols < PARALLEL_MIN_PIXELS ? 1 : min(worker_count(), tile_total);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker, false));
+    }
+    worker(true);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    engine_stats.tiles += tile_total;
+    engine_stats.pixels += (long long)rows * cols;
+}
+
+//**************************************************************************************************//
+//                                      Transpose Kernels                                           //
+//**************************************************************************************************//
+
+// Every kernel writes row i of its output block from column i of its input block. Strides are
+// in bytes and may be negative: walking the input or output rows backwards mirrors the block
+// as it is transposed, which turns the transpose into a quarter turn either way.
+
+void transpose_4x4_32_scalar(const unsigned char* src, ptrdiff_t src_stride, unsigned char* dst,
+                             ptrdiff_t dst_stride) {
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            memcpy(dst + i * dst_stride + j * 4, src + j * src_stride + i * 4, 4);
+        }
+    }
+}
+
+void transpose_4x4_24_scalar(const unsigned char* src, ptrdiff_t src_stride, unsigned char* dst,
+                             ptrdiff_t dst_stride) {
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            const unsigned char* s = src + j * src_stride + i * 3;
+            unsigned char* d = dst + i * dst_stride + j * 3;
+            d[0] = s[0];
+            d[1] = s[1];
+            d[2] = s[2];
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Transposes four registers of four 32-bit lanes, each register a row
+inline void transpose_4x4_epi32(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+    __m128i ab_low = _mm_unpacklo_epi32(a, b);      // a0 b0 a1 b1
+    __m128i ab_high = _mm_unpackhi_epi32(a, b);     // a2 b2 a3 b3
+    __m128i cd_low = _mm_unpacklo_epi32(c, d);      // c0 d0 c1 d1
+    __m128i cd_high = _mm_unpackhi_epi32(c, d);     // c2 d2 c3 d3
+    a = _mm_unpacklo_epi64(ab_low, cd_low);         // a0 b0 c0 d0
+    b = _mm_unpackhi_epi64(ab_low, cd_low);         // a1 b1 c1 d1
+    c = _mm_unpacklo_epi64(ab_high, cd_high);       // a2 b2 c2 d2
+    d = _mm_unpackhi_epi64(ab_high, cd_high);       // a3 b3 c3 d3
+}
+
+// Loads four packed 24-bit pixels (12 bytes, nothing past them) into the low bytes of four lanes
+inline __m128i load_24(const unsigned char* src) {
+    uint32_t last;
+    memcpy(&last, src + 8, 4);
+    __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)src), _mm_cvtsi32_si128(last));
+#if defined(__SSSE3__)
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+#else
+    // Pixel i moves up i bytes to the start of lane i
+    const __m128i lane = _mm_setr_epi32(0xffffff, 0, 0, 0);
+    __m128i p0 = _mm_and_si128(v, lane);
+    __m128i p1 = _mm_and_si128(_mm_slli_si128(v, 1), _mm_slli_si128(lane, 4));
+    __m128i p2 = _mm_and_si128(_mm_slli_si128(v, 2), _mm_slli_si128(lane, 8));
+    __m128i p3 = _mm_and_si128(_mm_slli_si128(v, 3), _mm_slli_si128(lane, 12));
+    return _mm_or_si128(_mm_or_si128(p0, p1), _mm_or_si128(p2, p3));
+#endif
+}
+
+// Stores the low three bytes of each lane as four packed 24-bit pixels (12 bytes)
+inline void store_24(unsigned char* dst, __m128i v) {
+#if defined(__SSSE3__)
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+#else
+    const __m128i lane = _mm_setr_epi32(0xffffff, 0, 0, 0);
+    __m128i p0 = _mm_and_si128(v, lane);
+    __m128i p1 = _mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(lane, 4)), 1);
+    __m128i p2 = _mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(lane, 8)), 2);
+    __m128i p3 = _mm_srli_si128(_mm_and_si128(v, _mm_slli_si128(lane, 12)), 3);
+    v = _mm_or_si128(_mm_or_si128(p0, p1), _mm_or_si128(p2, p3));
+#endif
+    _mm_storel_epi64((__m128i*)dst, v);
+    uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+    memcpy(dst + 8, &last, 4);
+}
+#endif
+
+/**
+ * Transposes a 4x4 block of 32-bit pixels in registers
+ * @param src The block's first input row
+ * @param src_stride The bytes from one input row to the next
+ * @param dst The block's first output row
+ * @param dst_stride The bytes from one output row to the next
+ * @return nothing
+ */
+void transpose_4x4_32(const unsigned char* src, ptrdiff_t src_stride, unsigned char* dst, ptrdiff_t dst_stride) {
+#if defined(__SSE2__)
+    __m128i a = _mm_loadu_si128((const __m128i*)src);
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + src_stride));
+    __m128i c = _mm_loadu_si128((const __m128i*)(src + 2 * src_stride));
+    __m128i d = _mm_loadu_si128((const __m128i*)(src + 3 * src_stride));
+    transpose_4x4_epi32(a, b, c, d);
+    _mm_storeu_si128((__m128i*)dst, a);
+    _mm_storeu_si128((__m128i*)(dst + dst_stride), b);
+    _mm_storeu_si128((__m128i*)(dst + 2 * dst_stride), c);
+    _mm_storeu_si128((__m128i*)(dst + 3 * dst_stride), d);
+#elif defined(__ARM_NEON)
+    uint32x4x2_t ab = vtrnq_u32(vld1q_u32((const uint32_t*)src), vld1q_u32((const uint32_t*)(src + src_stride)));
+    uint32x4x2_t cd = vtrnq_u32(vld1q_u32((const uint32_t*)(src + 2 * src_stride)),
+                                vld1q_u32((const uint32_t*)(src + 3 * src_stride)));
+    vst1q_u32((uint32_t*)dst, vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0])));
+    vst1q_u32((uint32_t*)(dst + dst_stride), vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1])));
+    vst1q_u32((uint32_t*)(dst + 2 * dst_stride), vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0])));
+    vst1q_u32((uint32_t*)(dst + 3 * dst_stride), vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1])));
+#else
+    transpose_4x4_32_scalar(src, src_stride, dst, dst_stride);
+#endif
+}
+
+/**
+ * Transposes an 8x8 block of 32-bit pixels, in AVX2 registers where the CPU has them and
+ * otherwise as four 4x4 blocks
+ * @param src The block's first input row
+ * @param src_stride The bytes from one input row to the next
+ * @param dst The block's first output row
+ * @param dst_stride The bytes from one output row to the next
+ * @return nothing
+ */
+void transpose_8x8_32(const unsigned char* src, ptrdiff_t src_stride, unsigned char* dst, ptrdiff_t dst_stride) {
+#if defined(__AVX2__)
+    __m256i r[8], t[8], u[8];
+    for (int i = 0; i < 8; i++) {
+        r[i] = _mm256_loadu_si256((const __m256i*)(src + i * src_stride));
+    }
+    // Within each 128-bit half this is the 4x4 transpose; the halves are swapped last
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm256_storeu_si256((__m256i*)(dst + i * dst_stride), _mm256_permute2x128_si256(u[i], u[i + 4], 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + (i + 4) * dst_stride), _mm256_permute2x128_si256(u[i], u[i + 4], 0x31));
+    }
+#else
+    for (int i = 0; i < 8; i += 4) {
+        for (int j = 0; j < 8; j += 4) {
+            transpose_4x4_32(src + j * src_stride + i * 4, src_stride, dst + i * dst_stride + j * 4, dst_stride);
+        }
+    }
+#endif
+}
+
+/**
+ * Transposes a 4x4 block of packed 24-bit pixels: each row is widened to 32-bit lanes with
+ * shuffles, transposed in registers and packed again
+ * @param src The block's first input row
+ * @param src_stride The bytes from one input row to the next
+ * @param dst The block's first output row
+ * @param dst_stride The bytes from one output row to the next
+ * @return nothing
+ */
+void transpose_4x4_24(const unsigned char* src, ptrdiff_t src_stride, unsigned char* dst, ptrdiff_t dst_stride) {
+#if defined(__SSE2__)
+    __m128i a = load_24(src);
+    __m128i b = load_24(src + src_stride);
+    __m128i c = load_24(src + 2 * src_stride);
+    __m128i d = load_24(src + 3 * src_stride);
+    transpose_4x4_epi32(a, b, c, d);
+    store_24(dst, a);
+    store_24(dst + dst_stride, b);
+    store_24(dst + 2 * dst_stride, c);
+    store_24(dst + 3 * dst_stride, d);
+#else
+    transpose_4x4_24_scalar(src, src_stride, dst, dst_stride);
+#endif
+}
+
+// Encodes one row of pixels as BMP pixel array bytes, blue first
+void encode_row(const Pixel* row, int cols, unsigned char* dst) {
+    for (int col = 0; col < cols; col++) {
+        dst[0] = row[col].blue;
+        dst[1] = row[col].green;
+        dst[2] = row[col].red;
+        dst = dst + 3;
+    }
+}
+
+/**
+ * Encodes an image as a 24 bit BMP file in memory, rotated by a multiple of 90 degrees in the
+ * same direction as rotate_90() on the way. Quarter turns encode four input rows at a time and
+ * transpose them into place in 4x4 blocks, so the rotated image is never built.
+ * @param image The input image
+ * @param rotations The number of 90 degree turns
+ * @param buffer The file contents, reusing its storage between calls
+ * @param hash If not NULL, set to the hash_image() of the rotated image, computed from the
+ *             encoded rows
+ * @return nothing
+ */
+void encode_rotated(const Image& image, int rotations, vector<unsigned char>& buffer, uint64_t* hash = NULL) {
+    rotations = rotations % 4;
+    if (rotations == 0) {
+        encode_image(image, buffer);
+        if (hash != NULL) {
+            *hash = hash_image(image);
+        }
+        return;
+    }
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    int out_cols = rotations == 2 ? cols : rows;
+    int out_rows = rotations == 2 ? rows : cols;
+    buffer.resize(BMP_HEADER_SIZE + DIB_HEADER_SIZE);
+    size_t row_bytes = set_bmp_headers(buffer.data(), out_cols, out_rows);
+    // The pixel array starts zeroed, which leaves the padding at the end of each row zero
+    buffer.resize(BMP_HEADER_SIZE + DIB_HEADER_SIZE + row_bytes * out_rows, 0);
+    unsigned char* pixels = buffer.data() + BMP_HEADER_SIZE + DIB_HEADER_SIZE;
+    PixelHash row_hash;
+    hash_start(row_hash, out_cols, out_rows);
+
+    if (rotations == 2) {
+        // Rows are stored bottom to top, so file row f is input row f backwards. They are
+        // written from the last, the top of the output, so each is hashed as it is written.
+        for (int row = rows - 1; row >= 0; row--) {
+            unsigned char* dst = pixels + row * row_bytes;
+            const Pixel* src = image[row].data();
+            for (int col = cols - 1; col >= 0; col--) {
+                dst[0] = src[col].blue;
+                dst[1] = src[col].green;
+                dst[2] = src[col].red;
+                dst = dst + 3;
+            }
+            if (hash != NULL) {
+                hash_update(row_hash, pixels + row * row_bytes, (size_t)cols * 3);
+            }
+        }
+        if (hash != NULL) {
+            *hash = hash_finish(row_hash);
+        }
+        return;
+    }
+
+    // Input column col is file row col (one turn) or cols - 1 - col (three turns), and input
+    // row row is at position row or rows - 1 - row along it
+    ptrdiff_t strip_stride = (ptrdiff_t)cols * 3;
+    vector<unsigned char> strip(4 * strip_stride);
+    int full_cols = cols - cols % 4;
+    for (int top = 0; top < rows; top += 4) {
+        int height = min(4, rows - top);
+        for (int i = 0; i < height; i++) {
+            encode_row(image[top + i].data(), cols, strip.data() + i * strip_stride);
+        }
+        int left = 0;
+        if (height == 4) {
+            for (; left < full_cols; left += 4) {
+                if (rotations == 1) {
+                    transpose_4x4_24(strip.data() + left * 3, strip_stride,
+                                     pixels + left * row_bytes + top * 3, row_bytes);
+                } else {
+                    transpose_4x4_24(strip.data() + 3 * strip_stride + left * 3, -strip_stride,
+                                     pixels + (cols - 1 - left) * row_bytes + (rows - 4 - top) * 3,
+                                     -(ptrdiff_t)row_bytes);
+                }
+            }
+        }
+        // The last columns and rows that do not fill a block
+        for (int i = 0; i < height; i++) {
+            int row = top + i;
+            for (int col = height == 4 ? left : 0; col < cols; col++) {
+                unsigned char* dst = rotations == 1 ? pixels + col * row_bytes + row * 3
+                                                    : pixels + (cols - 1 - col) * row_bytes + (rows - 1 - row) * 3;
+                memcpy(dst, strip.data() + i * strip_stride + col * 3, 3);
+            }
+        }
+    }
+
+    // Every output row takes a column from each strip, so none is finished before the last
+    // strip; the encoded rows are hashed top to bottom once they all are
+    if (hash != NULL) {
+        for (int row = out_rows - 1; row >= 0; row--) {
+            hash_update(row_hash, pixels + row * row_bytes, (size_t)out_cols * 3);
+        }
+        *hash = hash_finish(row_hash);
+    }
+}
+
+//**************************************************************************************************//
+//                                        Filter kernels                                            //
+//**************************************************************************************************//
+
+// Builds the vignette scale factor of each pixel, unless the mask already fits the image size
+void build_vignette_mask(FilterState& state, int rows, int cols) {
+    if (state.mask_rows == rows && state.mask_cols == cols) {
+        return;
+    }
+    state.mask.resize((size_t)rows * cols);
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            // find distance to center
+            double dist = sqrt(pow((col - (cols/2.0)), 2.0) + pow(row - (rows/2.0), 2.0));
+            state.mask[(size_t)row * cols + col] = (rows - dist)/ rows;
+        }
+    }
+    state.mask_rows = rows;
+    state.mask_cols = cols;
+}
+
+void vignette_row(const Pixel* src, Pixel* dst, const double* scale_factor, int cols) {
+    for (int col = 0; col < cols; col++) {
+        dst[col].red = src[col].red * scale_factor[col];
+        dst[col].green = src[col].green * scale_factor[col];
+        dst[col].blue = src[col].blue * scale_factor[col];
+    }
+}
+
+void vignette(const Image& image, Image& new_image, FilterState& state) {
+    int rows, cols;
+    tie(rows,cols) = size_image(image);
+    build_vignette_mask(state, rows, cols);
+    size_image_to(new_image, rows, cols);
+    CancelToken* token = current_job;
+    for (int row = 0; row < rows; row++) {
+        if (row % tile_size == 0 && between_tiles(token, true)) {
+            break;
+        }
+        vignette_row(image[row].data(), new_image[row].data(), state.mask.data() + (size_t)row * cols, cols);
+    }
+}
+
+Pixel clarendon_pixel(Pixel p, const FilterState& state) {
+    int avg = (p.red + p.blue + p.green) / 3;
+    // if pixel is light, make lighter
+    if (avg >= 170) {
+        p.red = lighten_value(state, p.red);
+        p.green = lighten_value(state, p.green);
+        p.blue = lighten_value(state, p.blue);
+    } else if (avg < 90) {
+        p.red = darken_value(state, p.red);
+        p.green = darken_value(state, p.green);
+        p.blue = darken_value(state, p.blue);
+    }
+    return p;
+}
+
+Pixel greyscale_pixel(Pixel p) {
+    int avg = (p.red + p.blue + p.green) / 3;
+    return new_pixel(avg, avg, avg);
+}
+
+Pixel high_contrast_pixel(Pixel p) {
+    double avg = (p.red + p.blue + p.green) / 3.0;
+    int v = avg >= 127.5 ? 255 : 0;
+    return new_pixel(v, v, v);
+}
+
+Pixel lighten_pixel(Pixel p, const FilterState& state) {
+    return new_pixel(lighten_value(state, p.red), lighten_value(state, p.blue), lighten_value(state, p.green));
+}
+
+Pixel darken_pixel(Pixel p, const FilterState& state) {
+    return new_pixel(darken_value(state, p.red), darken_value(state, p.blue), darken_value(state, p.green));
+}
+
+Pixel primary_color(Pixel p) {
+    int red, blue, green;
+    tie(red, blue, green) = rbg_pixel(p);
+    int mx = max(red, blue);
+    mx = max(mx, green);
+    int sum = red + blue + green;
+    if (sum >= 550) {
+        return new_pixel(255, 255, 255);
+    } else if (sum <= 150) {
+        return new_pixel(0, 0, 0);
+    } else if (mx == red) {
+        return new_pixel(255, 0, 0);
+    } else if (mx == green) {
+        return new_pixel(0, 0, 255);
+    } else {
+        return new_pixel(0, 255, 0);
+    }
+}
+
+void enlarge(const Image& image, Image& new_image, int x, int y) {
+    int rows, cols;
+    tie(rows,cols) = size_image(image);
+    size_image_to(new_image, rows * y, cols * x);
+    bool streaming = (size_t)rows * y * cols * x * sizeof(Pixel) >= streaming_store_bytes;
+    // Each source row becomes one wide row, copied y times
+    vector<Pixel> wide(streaming ? cols * x : 0);
+    CancelToken* token = current_job;
+    for (int row = 0; row < rows; row++) {
+        // Each input row writes x * y output pixels per column, as much as a tile or more
+        if (between_tiles(token, true)) {
+            break;
+        }
+        const Pixel* src = image[row].data();
+        Pixel* dst = streaming ? wide.data() : new_image[row * y].data();
+        for (int col = 0; col < cols; col++) {
+            for (int i = 0; i < x; i++) {
+                *dst++ = src[col];
+            }
+        }
+        for (int i = streaming ? 0 : 1; i < y; i++) {
+            if (streaming) {
+                stream_copy(new_image[row * y + i].data(), wide.data(), wide.size() * sizeof(Pixel));
+            } else {
+                new_image[row * y + i] = new_image[row * y];
+            }
+        }
+    }
+    if (streaming) {
+        stream_fence();
+    }
+}
+
+#if defined(__SSE2__)
+static_assert(sizeof(Pixel) == 3 * sizeof(int), "reverse_4 expects pixels of three ints");
+
+// Reverses four pixels held as three registers of ints, a = r0 g0 b0 r1, b = g1 b1 r2 g2 and
+// c = b2 r3 g3 b3, the order they are in memory
+inline void reverse_4(__m128& a, __m128& b, __m128& c) {
+    __m128 b3_c0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 0, 3, 3));        // g2 g2 b2 b2
+    __m128 a3_b0 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 3, 3));        // r1 r1 g1 g1
+    __m128 c3_b2 = _mm_shuffle_ps(c, b, _MM_SHUFFLE(2, 2, 3, 3));        // b3 b3 r2 r2
+    __m128 b1_a0 = _mm_shuffle_ps(b, a, _MM_SHUFFLE(0, 0, 1, 1));        // b1 b1 r0 r0
+    __m128 first = _mm_shuffle_ps(c, c3_b2, _MM_SHUFFLE(2, 0, 2, 1));    // r3 g3 b3 r2
+    __m128 second = _mm_shuffle_ps(b3_c0, a3_b0, _MM_SHUFFLE(2, 0, 2, 0)); // g2 b2 r1 g1
+    __m128 third = _mm_shuffle_ps(b1_a0, a, _MM_SHUFFLE(2, 1, 2, 0));    // b1 r0 g0 b0
+    a = first;
+    b = second;
+    c = third;
+}
+
+inline void load_4(const Pixel* src, __m128& a, __m128& b, __m128& c) {
+    a = _mm_loadu_ps((const float*)src);
+    b = _mm_loadu_ps((const float*)src + 4);
+    c = _mm_loadu_ps((const float*)src + 8);
+}
+
+inline void store_4(Pixel* dst, __m128 a, __m128 b, __m128 c) {
+    _mm_storeu_ps((float*)dst, a);
+    _mm_storeu_ps((float*)dst + 4, b);
+    _mm_storeu_ps((float*)dst + 8, c);
+}
+#endif
+
+// Copies a row of pixels in reverse order, four pixels at a time in registers where the CPU can
+void reverse_pixels(const Pixel* src, Pixel* dst, int cols) {
+    int col = 0;
+#if defined(__SSE2__)
+    for (; col + 4 <= cols; col += 4) {
+        __m128 a, b, c;
+        load_4(src + cols - 4 - col, a, b, c);
+        reverse_4(a, b, c);
+        store_4(dst + col, a, b, c);
+    }
+#endif
+    for (; col < cols; col++) {
+        dst[col] = src[cols - 1 - col];
+    }
+}
+
+// Reverses a row of pixels in place, swapping four pixels from each end at a time
+void reverse_pixels_in_place(Pixel* row, int cols) {
+    int col = 0;
+#if defined(__SSE2__)
+    for (; col + 4 <= cols - 4 - col; col += 4) {
+        __m128 a, b, c, x, y, z;
+        load_4(row + col, a, b, c);
+        load_4(row + cols - 4 - col, x, y, z);
+        reverse_4(a, b, c);
+        reverse_4(x, y, z);
+        store_4(row + col, x, y, z);
+        store_4(row + cols - 4 - col, a, b, c);
+    }
+#endif
+    reverse(row + col, row + cols - col);
+}
+
+/**
+ * Rotates an image by 180 degrees: the pixels in reverse order, last row first and each row
+ * backwards, so it is a reversed linear copy with no transpose. Large images are split across
+ * worker threads a band of rows at a time, and a cancelled job stops between bands.
+ * @param image The input image
+ * @param new_image The rotated image, reusing its storage when the size is unchanged
+ * @return nothing
+ */
+void rotate_180(const Image& image, Image& new_image) {
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    size_image_to(new_image, rows, cols);
+    int band = tile_size;
+    int bands = (rows + band - 1) / band;
+    atomic<int> next_band(0);
+    CancelToken* token = current_job;
+    auto worker = [&](bool owner) {
+        for (int b = next_band++; b < bands; b = next_band++) {
+            if (between_tiles(token, owner)) {
+                break;
+            }
+            for (int row = b * band; row < min(rows, (b + 1) * band); row++) {
+                reverse_pixels(image[row].data(), new_image[(rows - 1) - row].data(), cols);
+            }
+        }
+    };
+    int workers = (long long)rows * cols < PARALLEL_MIN_PIXELS ? 1 : min(worker_count(), bands);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker, false));
+    }
+    worker(true);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+Image rotate_180(const Image& image) {
+    Image new_image;
+    rotate_180(image, new_image);
+    return new_image;
+}
+
+/**
+ * Rotates an image by 180 degrees in place. The rows trade places by swapping their storage,
+ * which moves no pixels, and then each row is reversed from both ends at once.
+ * @param image The image to rotate
+ * @return nothing
+ */
+void rotate_180_in_place(Image& image) {
+    reverse(image.begin(), image.end());
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    CancelToken* token = current_job;
+    for (int row = 0; row < rows; row++) {
+        if (row % tile_size == 0 && between_tiles(token, true)) {
+            break;
+        }
+        reverse_pixels_in_place(image[row].data(), cols);
+    }
+}
+
+// Pieces of a recursive quarter turn are split down to blocks this size
+const int RECURSIVE_BASE = 4;
+// A cancelled job stops before any piece of a recursive quarter turn this size or smaller
+const long long RECURSIVE_CHECK_PIXELS = 64 * 64;
+
+// A rectangle of an image: rows [top, bottom) and columns [left, right)
+struct Region
+{
+    int top;
+    int left;
+    int bottom;
+    int right;
+};
+
+/**
+ * Copies one region of a quarter turn pixel by pixel
+ * @param image The input image
+ * @param new_image The rotated image
+ * @param region The input pixels to copy
+ * @param rotations 1 or 3
+ * @return nothing
+ */
+void rotate_region(const Image& image, Image& new_image, const Region& region, int rotations) {
+    int rows = image.size(), cols = image[0].size();
+    for (int row = region.top; row < region.bottom; row++) {
+        const Pixel* src = image[row].data();
+        for (int col = region.left; col < region.right; col++) {
+            if (rotations == 1) {
+                new_image[(cols - 1) - col][row] = src[col];
+            } else {
+                new_image[col][(rows - 1) - row] = src[col];
+            }
+        }
+    }
+}
+
+/**
+ * Copies a full 4x4 block of a quarter turn. Each output row takes one column of the block, so
+ * the four input rows and four output rows are each touched once.
+ * @param image The input image
+ * @param new_image The rotated image
+ * @param top, left The block's first input row and column
+ * @param rotations 1 or 3
+ * @return nothing
+ */
+void rotate_4x4(const Image& image, Image& new_image, int top, int left, int rotations) {
+    int rows = image.size(), cols = image[0].size();
+    const Pixel* src[4] = {image[top].data() + left, image[top + 1].data() + left,
+                           image[top + 2].data() + left, image[top + 3].data() + left};
+    for (int i = 0; i < 4; i++) {
+        Pixel* dst;
+        if (rotations == 1) {
+            // Column left + i lands on output row cols - 1 - left - i, input rows in order
+            dst = new_image[(cols - 1) - left - i].data() + top;
+            dst[0] = src[0][i];
+            dst[1] = src[1][i];
+            dst[2] = src[2][i];
+            dst[3] = src[3][i];
+        } else {
+            // Column left + i lands on output row left + i, input rows reversed
+            dst = new_image[left + i].data() + (rows - 4) - top;
+            dst[0] = src[3][i];
+            dst[1] = src[2][i];
+            dst[2] = src[1][i];
+            dst[3] = src[0][i];
+        }
+    }
+}
+
+/**
+ * Splits a region in half across its longer side, keeping the cut on a multiple of
+ * RECURSIVE_BASE from the region's start so the pieces stay whole blocks
+ * @param region The region, at least two blocks long on its longer side
+ * @param first, second Set to the two halves
+ * @return nothing
+ */
+void split_region(const Region& region, Region& first, Region& second) {
+    first = region;
+    second = region;
+    int rows = region.bottom - region.top, cols = region.right - region.left;
+    if (rows >= cols) {
+        int half = (rows / RECURSIVE_BASE + 1) / 2 * RECURSIVE_BASE;
+        first.bottom = second.top = region.top + half;
+    } else {
+        int half = (cols / RECURSIVE_BASE + 1) / 2 * RECURSIVE_BASE;
+        first.right = second.left = region.left + half;
+    }
+}
+
+/**
+ * Copies a region of a quarter turn by halving it until the pieces are single blocks. Whatever
+ * the cache sizes, some level of the recursion has pieces whose input and output rows fit in
+ * each cache, so no block size has to be tuned.
+ * @param image The input image
+ * @param new_image The rotated image
+ * @param region The input pixels to copy
+ * @param rotations 1 or 3
+ * @param token The job the rotation belongs to, or NULL
+ * @param owner True on the thread that started the job
+ * @return False if the job was cancelled and true otherwise
+ */
+bool rotate_recursive(const Image& image, Image& new_image, const Region& region, int rotations,
+                      const CancelToken* token, bool owner) {
+    int rows = region.bottom - region.top, cols = region.right - region.left;
+    if (rows <= RECURSIVE_BASE && cols <= RECURSIVE_BASE) {
+        if (rows == RECURSIVE_BASE && cols == RECURSIVE_BASE) {
+            rotate_4x4(image, new_image, region.top, region.left, rotations);
+        } else {
+            rotate_region(image, new_image, region, rotations);
+        }
+        return true;
+    }
+    if (rows < RECURSIVE_BASE * 2 && cols < RECURSIVE_BASE * 2) {
+        // Too small to split into whole blocks
+        rotate_region(image, new_image, region, rotations);
+        return true;
+    }
+    Region halves[2];
+    split_region(region, halves[0], halves[1]);
+    for (int i = 0; i < 2; i++) {
+        long long pixels = (long long)(halves[i].bottom - halves[i].top) * (halves[i].right - halves[i].left);
+        bool check = pixels <= RECURSIVE_CHECK_PIXELS && (long long)rows * cols > RECURSIVE_CHECK_PIXELS;
+        if ((check && between_tiles(token, owner))
+            || !rotate_recursive(image, new_image, halves[i], rotations, token, owner)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Splits the image into pieces for the worker threads the same way rotate_recursive() would,
+ * so each piece is itself a cache friendly region
+ * @param region The region to split
+ * @param pixels The largest piece wanted
+ * @param pieces The pieces are added here
+ * @return nothing
+ */
+void split_for_workers(const Region& region, long long pixels, vector<Region>& pieces) {
+    int rows = region.bottom - region.top, cols = region.right - region.left;
+    if ((long long)rows * cols <= pixels || (rows < RECURSIVE_BASE * 2 && cols < RECURSIVE_BASE * 2)) {
+        pieces.push_back(region);
+        return;
+    }
+    Region first, second;
+    split_region(region, first, second);
+    split_for_workers(first, pixels, pieces);
+    split_for_workers(second, pixels, pieces);
+}
+
+/**
+ * Rotates an image by a multiple of 90 degrees. A quarter turn reads rows and writes columns,
+ * so it is done a piece at a time: each output row's cache lines are filled by consecutive
+ * input rows instead of being evicted between them. The pieces are the halves of the halves of
+ * the image with rotate_kernel ROTATE_RECURSIVE, or square blocks of rotate_block pixels with
+ * ROTATE_BLOCKED. Pieces of large images are split across worker threads, and a cancelled job
+ * stops between pieces.
+ * @param image The input image
+ * @param rotations The number of 90 degree turns
+ * @return the rotated image
+ */
+Image rotate_90(const Image& image, int rotations) {
+    // 4 is a 360 so true number of spins is num % 4
+    rotations = rotations % 4;
+    if (rotations == 0) {
+        return image;
+    }
+    if (rotations == 2) {
+        return rotate_180(image);
+    }
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    Image new_image(cols, vector<Pixel> (rows));
+    vector<Region> pieces;
+    Region whole = {0, 0, rows, cols};
+    bool recursive = rotate_kernel == ROTATE_RECURSIVE;
+    int workers = (long long)rows * cols < PARALLEL_MIN_PIXELS ? 1 : worker_count();
+    if (recursive) {
+        // A few pieces per worker so they finish together
+        split_for_workers(whole, max((long long)rows * cols / (workers * 8), RECURSIVE_CHECK_PIXELS), pieces);
+    } else {
+        int block = rotate_block;
+        for (int top = 0; top < rows; top += block) {
+            for (int left = 0; left < cols; left += block) {
+                Region piece = {top, left, min(top + block, rows), min(left + block, cols)};
+                pieces.push_back(piece);
+            }
+        }
+    }
+    int piece_total = pieces.size();
+    atomic<int> next_piece(0);
+    CancelToken* token = current_job;
+
+    auto worker = [&](bool owner) {
+        for (int p = next_piece++; p < piece_total; p = next_piece++) {
+            if (between_tiles(token, owner)) {
+                break;
+            }
+            if (!recursive) {
+                rotate_region(image, new_image, pieces[p], rotations);
+            } else if (!rotate_recursive(image, new_image, pieces[p], rotations, token, owner)) {
+                break;
+            }
+        }
+    };
+
+    workers = min(workers, piece_total);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker, false));
+    }
+    worker(true);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    return new_image;
+}
+
+/**
+ * Runs the filter described by the state, writing into new_image
+ * @param image The input image
+ * @param new_image The output image, reusing its storage when the output size is unchanged
+ * @param state The filter settings and their precomputed tables
+ * @return nothing
+ */
+void run_filter(const Image& image, Image& new_image, FilterState& state) {
+    const FilterState& s = state;
+    switch (state.spec.selection) {
+        case 1: vignette(image, new_image, state); break;
+        case 2: map_pixels(image, new_image, [&s](Pixel p) { return clarendon_pixel(p, s); }); break;
+        case 3: map_pixels(image, new_image, greyscale_pixel); break;
+        case 4:
+        case 5:
+            // Half turns are a reversed copy rather than two quarter turns
+            if (state.spec.rotations % 4 == 2) {
+                rotate_180(image, new_image);
+            } else {
+                new_image = rotate_90(image, state.spec.rotations);
+            }
+            break;
+        case 6: enlarge(image, new_image, state.spec.x_scale, state.spec.y_scale); break;
+        case 7: map_pixels(image, new_image, high_contrast_pixel); break;
+        case 8: map_pixels(image, new_image, [&s](Pixel p) { return lighten_pixel(p, s); }); break;
+        case 9: map_pixels(image, new_image, [&s](Pixel p) { return darken_pixel(p, s); }); break;
+        case 10: map_pixels(image, new_image, primary_color); break;
+    }
+}
+
+Image apply_filter(const Image& image, const FilterSpec& spec) {
+    FilterState state = new_state(spec);
+    Image new_image;
+    run_filter(image, new_image, state);
+    return new_image;
+}
+
+bool point_wise(int selection) {
+    return selection != 4 && selection != 5 && selection != 6;
+}
+
+// Runs a point-wise filter over one row; the vignette mask must already be built
+void filter_row(const FilterState& state, const Pixel* src, Pixel* dst, int row, int cols) {
+    switch (state.spec.selection) {
+        case 1: vignette_row(src, dst, state.mask.data() + (size_t)row * cols, cols); break;
+        case 2: for (int col = 0; col < cols; col++) dst[col] = clarendon_pixel(src[col], state); break;
+        case 3: for (int col = 0; col < cols; col++) dst[col] = greyscale_pixel(src[col]); break;
+        case 7: for (int col = 0; col < cols; col++) dst[col] = high_contrast_pixel(src[col]); break;
+        case 8: for (int col = 0; col < cols; col++) dst[col] = lighten_pixel(src[col], state); break;
+        case 9: for (int col = 0; col < cols; col++) dst[col] = darken_pixel(src[col], state); break;
+        case 10: for (int col = 0; col < cols; col++) dst[col] = primary_color(src[col]); break;
+    }
+}
+
+/**
+ * Runs several filters over one image. The point-wise filters share a single pass over the
+ * input: each source row is read from memory once and written to every output while it is
+ * still in cache. Rotations share one 90 degree rotation of the input.
+ * @param image The input image
+ * @param states The filters to run
+ * @param outputs Set to one output image per filter, in the same order
+ * @return nothing
+ */
+void fan_out(const Image& image, vector<FilterState>& states, vector<Image>& outputs) {
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    outputs.resize(states.size());
+    vector<size_t> point;
+    for (size_t k = 0; k < states.size(); k++) {
+        if (point_wise(states[k].spec.selection)) {
+            if (states[k].spec.selection == 1) {
+                build_vignette_mask(states[k], rows, cols);
+            }
+            size_image_to(outputs[k], rows, cols);
+            point.push_back(k);
+        }
+    }
+
+    // Rows are handed out in bands so each worker streams through the input
+    const int band = 16;
+    atomic<int> next_row(0);
+    auto worker = [&] {
+        for (int top = next_row.fetch_add(band); top < rows; top = next_row.fetch_add(band)) {
+            int bottom = min(top + band, rows);
+            for (int row = top; row < bottom; row++) {
+                for (size_t i = 0; i < point.size(); i++) {
+                    size_t k = point[i];
+                    filter_row(states[k], image[row].data(), outputs[k][row].data(), row, cols);
+                }
+            }
+        }
+    };
+    long long work = (long long)rows * cols * point.size();
+    int workers = work < PARALLEL_MIN_PIXELS ? 1 : min(worker_count(), (rows + band - 1) / band);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    // 90 and 270 degrees both come from the one quarter turn; 180 degrees needs no transpose
+    Image quarter;
+    for (size_t k = 0; k < states.size(); k++) {
+        int selection = states[k].spec.selection;
+        if (selection == 6) {
+            run_filter(image, outputs[k], states[k]);
+            continue;
+        }
+        if (selection != 4 && selection != 5) {
+            continue;
+        }
+        int rotations = states[k].spec.rotations % 4;
+        if (rotations % 2 == 1 && quarter.empty()) {
+            quarter = rotate_90(image, 1);
+        }
+        if (rotations == 0) {
+            outputs[k] = image;
+        } else if (rotations == 1) {
+            outputs[k] = quarter;
+        } else if (rotations == 2) {
+            rotate_180(image, outputs[k]);
+        } else {
+            rotate_180(quarter, outputs[k]);
+        }
+    }
+}
+
+//**************************************************************************************************//
+//                               Image Processing functions                                         //
+//**************************************************************************************************//
+
+Image process_1(const Image& image) {
+    return apply_filter(image, get_filter_spec(1));
+}
+
+Image process_2(const Image& image) {
+    return apply_filter(image, get_filter_spec(2));
+}
+
+Image process_3(const Image& image) {
+    return apply_filter(image, get_filter_spec(3));
+}
+
+Image process_4(const Image& image) {
+    return rotate_90(image, 1);
+}
+
+Image process_5(const Image& image) {
+    return apply_filter(image, get_filter_spec(5));
+}
+
+Image process_6(const Image& image) {
+    return apply_filter(image, get_filter_spec(6));
+}
+
+Image process_7(const Image& image) {
+    return apply_filter(image, get_filter_spec(7));
+}
+
+Image process_8(const Image& image) {
+    return apply_filter(image, get_filter_spec(8));
+}
+
+Image process_9(const Image& image) {
+    return apply_filter(image, get_filter_spec(9));
+}
+
+Image process_10(const Image& image) {
+    return apply_filter(image, get_filter_spec(10));
+}
+
+//**************************************************************************************************//
+//                                       LZ Compression                                             //
+//**************************************************************************************************//
+
+// A byte-oriented LZ77 codec in the style of LZ4, used for tiles and cached intermediates. A block
+// is a series of sequences, each a token byte (literal count in the high four bits, match length
+// minus four in the low four bits), extra literal count bytes, the literals, a two byte match
+// offset and extra match length bytes. Counts of 15 or more continue in following bytes, each
+// adding up to 255. The last sequence has literals only.
+const int LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 16;
+const size_t LZ_MAX_OFFSET = 65535;
+
+/**
+ * The largest size lz_compress() can produce
+ * @param size the uncompressed size
+ * @return the size the output buffer needs
+ */
+size_t lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+inline uint32_t load32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+unsigned char* lz_write_count(unsigned char* dst, size_t count)
+{
+    while (count >= 255)
+    {
+        *dst++ = 255;
+        count = count - 255;
+    }
+    *dst++ = (unsigned char)count;
+    return dst;
+}
+
+// Length of the common prefix of a and b, comparing at most limit bytes
+inline size_t lz_match_length(const unsigned char* a, const unsigned char* b, size_t limit)
+{
+    size_t len = 0;
+    while (len + 8 <= limit)
+    {
+        uint64_t diff = load64(a + len) ^ load64(b + len);
+        if (diff != 0)
+        {
+            return len + (__builtin_ctzll(diff) >> 3);
+        }
+        len = len + 8;
+    }
+    while (len < limit && a[len] == b[len])
+    {
+        len++;
+    }
+    return len;
+}
+
+/**
+ * Compresses a block of bytes
+ * @param src  the bytes to compress
+ * @param size the number of bytes
+ * @param out  set to the compressed block
+ * @return the compressed size
+ */
+size_t lz_compress(const unsigned char src[], size_t size, vector<unsigned char>& out)
+{
+    out.resize(lz_bound(size));
+    unsigned char* dst = out.data();
+
+    // The table is kept per thread, since a tile is only a few times its size. Entries hold
+    // base + position, so anything from an earlier call is below base and reads as position 0,
+    // as in a fresh table; the table is only cleared when base would wrap.
+    static thread_local vector<uint32_t> table;
+    static thread_local uint32_t base = 0;
+    if (table.empty() || (uint64_t)base + size >= UINT32_MAX)
+    {
+        table.assign(1 << LZ_HASH_BITS, 0);
+        base = 1;
+    }
+
+    size_t anchor = 0;
+    size_t pos = 1;
+    while (pos + LZ_MIN_MATCH <= size)
+    {
+        uint32_t sequence = load32(src + pos);
+        uint32_t h = lz_hash(sequence);
+        size_t candidate = table[h] >= base ? table[h] - base : 0;
+        table[h] = base + pos;
+        if (pos - candidate > LZ_MAX_OFFSET || load32(src + candidate) != sequence)
+        {
+            // Step further the longer nothing has matched, so incompressible data stays fast
+            pos = pos + 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH + lz_match_length(src + candidate + LZ_MIN_MATCH,
+                                                       src + pos + LZ_MIN_MATCH,
+                                                       size - pos - LZ_MIN_MATCH);
+        size_t literals = pos - anchor;
+        unsigned char* token = dst++;
+        *token = (unsigned char)(min(literals, (size_t)15) << 4);
+        if (literals >= 15)
+        {
+            dst = lz_write_count(dst, literals - 15);
+        }
+        memcpy(dst, src + anchor, literals);
+        dst = dst + literals;
+        size_t offset = pos - candidate;
+        *dst++ = (unsigned char)offset;
+        *dst++ = (unsigned char)(offset >> 8);
+        size_t extra = length - LZ_MIN_MATCH;
+        *token = *token | (unsigned char)min(extra, (size_t)15);
+        if (extra >= 15)
+        {
+            dst = lz_write_count(dst, extra - 15);
+        }
+        pos = pos + length;
+        anchor = pos;
+    }
+
+    // The rest of the input is stored as literals
+    size_t literals = size - anchor;
+    *dst++ = (unsigned char)(min(literals, (size_t)15) << 4);
+    if (literals >= 15)
+    {
+        dst = lz_write_count(dst, literals - 15);
+    }
+    if (literals > 0)
+    {
+        memcpy(dst, src + anchor, literals);
+    }
+    dst = dst + literals;
+    base = base + size + 1;
+
+    out.resize(dst - out.data());
+    return out.size();
+}
+
+/**
+ * Decompresses a block made by lz_compress()
+ * @param src      the compressed block
+ * @param size     the compressed size
+ * @param dst      the output, which must be exactly the uncompressed size
+ * @param dst_size the uncompressed size
+ * @return True if successful and false if the block is damaged
+ */
+bool lz_decompress(const unsigned char src[], size_t size, unsigned char dst[], size_t dst_size)
+{
+    const unsigned char* ip = src;
+    const unsigned char* ip_end = src + size;
+    unsigned char* op = dst;
+    unsigned char* op_end = dst + dst_size;
+    while (ip < ip_end)
+    {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= ip_end)
+                {
+                    return false;
+                }
+                b = *ip++;
+                literals = literals + b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(ip_end - ip) || literals > (size_t)(op_end - op))
+        {
+            return false;
+        }
+        // Short copies move a fixed 16 bytes when there is room, which is much faster than an
+        // exact length copy; the extra bytes are overwritten by what follows
+        if (literals <= 16 && ip_end - ip >= 16 && op_end - op >= 16)
+        {
+            memcpy(op, ip, 16);
+        }
+        else if (literals > 0)
+        {
+            memcpy(op, ip, literals);
+        }
+        ip = ip + literals;
+        op = op + literals;
+        if (ip == ip_end)
+        {
+            break;
+        }
+
+        if (ip_end - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip = ip + 2;
+        size_t length = token & 15;
+        if (length == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= ip_end)
+                {
+                    return false;
+                }
+                b = *ip++;
+                length = length + b;
+            } while (b == 255);
+        }
+        length = length + LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || length > (size_t)(op_end - op))
+        {
+            return false;
+        }
+        // A match may overlap its own output, which is how runs are stored. The copied span
+        // doubles each pass and stays a whole number of periods, so memcpy never overlaps.
+        const unsigned char* match = op - offset;
+        if (offset >= 16 && length <= 16 && op_end - op >= 16)
+        {
+            memcpy(op, match, 16);
+            op = op + length;
+            continue;
+        }
+        while (length > 0)
+        {
+            size_t chunk = min((size_t)(op - match), length);
+            memcpy(op, match, chunk);
+            op = op + chunk;
+            length = length - chunk;
+        }
+    }
+    return op == op_end;
+}
+
+//**************************************************************************************************//
+//                                       Tiled Image Files                                          //
+//**************************************************************************************************//
+
+// A tiled file stores an image as fixed size square tiles so any region can be read by touching
+// only the tiles it overlaps. Layout (little endian):
+//   header  "HTIL", version, width, height, tile size, tile count, 8 reserved bytes (32 bytes)
+//   index   per tile, left to right then top to bottom: data offset (8), data size (4), encoding (4)
+//   data    per tile, the tile's pixels as blue, green, red bytes row by row, LZ compressed, or one
+//           pixel if the tile is uniform
+const int TILED_HEADER_SIZE = 32;
+const int TILED_INDEX_ENTRY_SIZE = 16;
+const int TILED_VERSION = 1;
+
+// Tile encodings
+const int TILE_RAW = 0;
+const int TILE_UNIFORM = 1;
+const int TILE_LZ = 2;
+
+// A tiled file mapped into memory
+struct TiledFile
+{
+    int fd;
+    const unsigned char* data;
+    size_t size;
+    int width;
+    int height;
+    int tile_size;
+    int tiles_across;
+    int tiles_down;
+};
+
+uint64_t get_uint64(const unsigned char data[], size_t offset)
+{
+    uint64_t result = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        result = (result << 8) | data[offset + i];
+    }
+    return result;
+}
+
+void set_bytes64(unsigned char arr[], size_t offset, uint64_t value)
+{
+    set_bytes(arr, offset, 4, (int)(uint32_t)value);
+    set_bytes(arr, offset + 4, 4, (int)(uint32_t)(value >> 32));
+}
+
+/**
+ * Finds the pixel rectangle covered by a tile
+ * @param tiled The tiled file
+ * @param t The tile number
+ * @param top, left Set to the first row and column of the tile
+ * @param bottom, right Set to one past the last row and column of the tile
+ * @return nothing
+ */
+void tile_bounds(const TiledFile& tiled, int t, int& top, int& left, int& bottom, int& right) {
+    top = (t / tiled.tiles_across) * tiled.tile_size;
+    left = (t % tiled.tiles_across) * tiled.tile_size;
+    bottom = min(top + tiled.tile_size, tiled.height);
+    right = min(left + tiled.tile_size, tiled.width);
+}
+
+/**
+ * Encodes one tile of an image region
+ * @param image The image holding the tile
+ * @param top, left, bottom, right The tile's rectangle within the image
+ * @param compress True to store uniform tiles as a single pixel and LZ compress the others
+ * @param out The encoded tile data
+ * @return the tile encoding
+ */
+int encode_tile(const Image& image, int top, int left, int bottom, int right, bool compress,
+                vector<unsigned char>& out) {
+    if (compress && uniform_tile(image, top, left, bottom, right)) {
+        Pixel p = image[top][left];
+        out.resize(3);
+        out[0] = p.blue;
+        out[1] = p.green;
+        out[2] = p.red;
+        return TILE_UNIFORM;
+    }
+    out.resize((size_t)(bottom - top) * (right - left) * 3);
+    unsigned char* dst = out.data();
+    for (int row = top; row < bottom; row++) {
+        const Pixel* src = image[row].data();
+        for (int col = left; col < right; col++) {
+            dst[0] = src[col].blue;
+            dst[1] = src[col].green;
+            dst[2] = src[col].red;
+            dst = dst + 3;
+        }
+    }
+    if (compress) {
+        static thread_local vector<unsigned char> packed;
+        if (lz_compress(out.data(), out.size(), packed) < out.size()) {
+            out.swap(packed);
+            return TILE_LZ;
+        }
+    }
+    return TILE_RAW;
+}
+
+/**
+ * Writes tiles to a tiled file. The header and index are written once every tile is known, so
+ * tiles can be produced one at a time without holding the whole image.
+ * @param filename The tiled file to write
+ * @param width, height The image size
+ * @param tile_side The tile side length in pixels
+ * @param next_tile Called with a tile number, the tile's rectangle and a buffer; fills the buffer
+ *                  with the encoded tile and returns its encoding. Tiles are requested in order.
+ * @return True if successful and false otherwise
+ */
+template <typename TileSource>
+bool write_tiles(string filename, int width, int height, int tile_side, TileSource next_tile) {
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open()) {
+        return false;
+    }
+    TiledFile layout = TiledFile();
+    layout.width = width;
+    layout.height = height;
+    layout.tile_size = tile_side;
+    layout.tiles_across = (width + tile_side - 1) / tile_side;
+    layout.tiles_down = (height + tile_side - 1) / tile_side;
+    int tile_total = layout.tiles_across * layout.tiles_down;
+
+    vector<unsigned char> header(TILED_HEADER_SIZE + (size_t)tile_total * TILED_INDEX_ENTRY_SIZE, 0);
+    set_bytes(header.data(), 0, 1, 'H');
+    set_bytes(header.data(), 1, 1, 'T');
+    set_bytes(header.data(), 2, 1, 'I');
+    set_bytes(header.data(), 3, 1, 'L');
+    set_bytes(header.data(), 4, 4, TILED_VERSION);
+    set_bytes(header.data(), 8, 4, width);
+    set_bytes(header.data(), 12, 4, height);
+    set_bytes(header.data(), 16, 4, tile_side);
+    set_bytes(header.data(), 20, 4, tile_total);
+
+    // Reserve space for the header and index, then stream the tiles after it
+    stream.write((char*)header.data(), header.size());
+    uint64_t offset = header.size();
+    vector<unsigned char> tile;
+    for (int t = 0; t < tile_total; t++) {
+        int top, left, bottom, right;
+        tile_bounds(layout, t, top, left, bottom, right);
+        int encoding = next_tile(t, top, left, bottom, right, tile);
+        unsigned char* entry = header.data() + TILED_HEADER_SIZE + (size_t)t * TILED_INDEX_ENTRY_SIZE;
+        set_bytes64(entry, 0, offset);
+        set_bytes(entry, 8, 4, tile.size());
+        set_bytes(entry, 12, 4, encoding);
+        stream.write((char*)tile.data(), tile.size());
+        offset = offset + tile.size();
+    }
+    stream.seekp(0);
+    stream.write((char*)header.data(), header.size());
+    stream.close();
+    return !stream.fail();
+}
+
+/**
+ * Writes an image as a tiled file
+ * @param filename The tiled file to write
+ * @param image The image
+ * @param tile_side The tile side length in pixels
+ * @param compress True to store uniform tiles as a single pixel and LZ compress the others
+ * @return True if successful and false otherwise
+ */
+bool write_tiled(string filename, const Image& image, int tile_side, bool compress) {
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    return write_tiles(filename, cols, rows, tile_side,
+        [&](int, int top, int left, int bottom, int right, vector<unsigned char>& tile) {
+            return encode_tile(image, top, left, bottom, right, compress, tile);
+        });
+}
+
+/**
+ * Maps a tiled file into memory and checks its header and index
+ * @param filename The tiled file
+ * @param tiled Set to the mapped file on success
+ * @return True if successful and false otherwise
+ */
+bool open_tiled(string filename, TiledFile& tiled) {
+    tiled.fd = open(filename.c_str(), O_RDONLY);
+    if (tiled.fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(tiled.fd, &info) != 0 || info.st_size < TILED_HEADER_SIZE) {
+        close(tiled.fd);
+        return false;
+    }
+    tiled.size = info.st_size;
+    void* mapped = mmap(NULL, tiled.size, PROT_READ, MAP_SHARED, tiled.fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(tiled.fd);
+        return false;
+    }
+    tiled.data = (const unsigned char*)mapped;
+    tiled.width = get_int(tiled.data, 8, 4);
+    tiled.height = get_int(tiled.data, 12, 4);
+    tiled.tile_size = get_int(tiled.data, 16, 4);
+    bool valid = memcmp(tiled.data, "HTIL", 4) == 0 && get_int(tiled.data, 4, 4) == TILED_VERSION
+        && tiled.width > 0 && tiled.height > 0 && tiled.tile_size > 0;
+    if (valid) {
+        tiled.tiles_across = (tiled.width + tiled.tile_size - 1) / tiled.tile_size;
+        tiled.tiles_down = (tiled.height + tiled.tile_size - 1) / tiled.tile_size;
+        size_t tile_total = (size_t)tiled.tiles_across * tiled.tiles_down;
+        valid = get_int(tiled.data, 20, 4) == (int)tile_total
+            && TILED_HEADER_SIZE + tile_total * TILED_INDEX_ENTRY_SIZE <= tiled.size;
+        for (size_t t = 0; valid && t < tile_total; t++) {
+            const unsigned char* entry = tiled.data + TILED_HEADER_SIZE + t * TILED_INDEX_ENTRY_SIZE;
+            uint64_t offset = get_uint64(entry, 0);
+            uint64_t size = (uint32_t)get_int(entry, 8, 4);
+            valid = offset <= tiled.size && size <= tiled.size - offset;
+        }
+    }
+    if (!valid) {
+        munmap(mapped, tiled.size);
+        close(tiled.fd);
+        return false;
+    }
+    return true;
+}
+
+void close_tiled(TiledFile& tiled) {
+    munmap((void*)tiled.data, tiled.size);
+    close(tiled.fd);
+}
+
+/**
+ * Decodes one tile, copying the part of it that overlaps a region into the region image
+ * @param tiled The tiled file
+ * @param t The tile number
+ * @param top, left The region's first row and column in the full image
+ * @param region The region image; only pixels inside both the tile and the region are written
+ * @return True if successful and false if the tile data is damaged
+ */
+bool read_tile(const TiledFile& tiled, int t, int top, int left, Image& region) {
+    int tile_top, tile_left, tile_bottom, tile_right;
+    tile_bounds(tiled, t, tile_top, tile_left, tile_bottom, tile_right);
+    int tile_cols = tile_right - tile_left;
+    const unsigned char* entry = tiled.data + TILED_HEADER_SIZE + (size_t)t * TILED_INDEX_ENTRY_SIZE;
+    const unsigned char* src = tiled.data + get_uint64(entry, 0);
+    size_t size = (uint32_t)get_int(entry, 8, 4);
+    int encoding = get_int(entry, 12, 4);
+
+    int rows = region.size();
+    int cols = rows > 0 ? region[0].size() : 0;
+    int first_row = max(tile_top, top), last_row = min(tile_bottom, top + rows);
+    int first_col = max(tile_left, left), last_col = min(tile_right, left + cols);
+    if (encoding == TILE_UNIFORM && size == 3) {
+        for (int row = first_row; row < last_row; row++) {
+            Pixel* dst = region[row - top].data();
+            for (int col = first_col; col < last_col; col++) {
+                dst[col - left] = new_pixel(src[2], src[0], src[1]);
+            }
+        }
+        return true;
+    }
+    size_t raw_size = (size_t)(tile_bottom - tile_top) * tile_cols * 3;
+    if (encoding == TILE_LZ) {
+        static thread_local vector<unsigned char> unpacked;
+        unpacked.resize(raw_size);
+        if (!lz_decompress(src, size, unpacked.data(), raw_size)) {
+            return false;
+        }
+        src = unpacked.data();
+    } else if (encoding != TILE_RAW || size != raw_size) {
+        return false;
+    }
+    for (int row = first_row; row < last_row; row++) {
+        const unsigned char* p = src + ((size_t)(row - tile_top) * tile_cols + (first_col - tile_left)) * 3;
+        Pixel* dst = region[row - top].data();
+        for (int col = first_col; col < last_col; col++) {
+            dst[col - left] = new_pixel(p[2], p[0], p[1]);
+            p = p + 3;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a rectangle of a tiled file, decoding only the tiles it overlaps. Tiles are decoded on
+ * worker threads when the region is large.
+ * @param tiled The tiled file
+ * @param top, left The region's first row and column
+ * @param rows, cols The region size, clipped to the image
+ * @param region Set to the region's pixels
+ * @return True if successful and false otherwise
+ */
+bool read_tiled_region(const TiledFile& tiled, int top, int left, int rows, int cols, Image& region) {
+    if (top < 0 || left < 0 || top >= tiled.height || left >= tiled.width || rows < 1 || cols < 1) {
+        return false;
+    }
+    rows = min(rows, tiled.height - top);
+    cols = min(cols, tiled.width - left);
+    size_image_to(region, rows, cols);
+
+    int first_tile_row = top / tiled.tile_size, last_tile_row = (top + rows - 1) / tiled.tile_size;
+    int first_tile_col = left / tiled.tile_size, last_tile_col = (left + cols - 1) / tiled.tile_size;
+    int across = last_tile_col - first_tile_col + 1;
+    int tile_total = (last_tile_row - first_tile_row + 1) * across;
+    atomic<int> next_tile(0);
+    atomic<bool> ok(true);
+    auto worker = [&] {
+        for (int i = next_tile++; i < tile_total; i = next_tile++) {
+            int t = (first_tile_row + i / across) * tiled.tiles_across + first_tile_col + i % across;
+            if (!read_tile(tiled, t, top, left, region)) {
+                ok = false;
+            }
+        }
+    };
+    int workers = (long long)rows * cols < PARALLEL_MIN_PIXELS ? 1 : min(worker_count(), tile_total);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    return ok;
+}
+
+/**
+ * Reads a whole tiled file
+ * @param filename The tiled file
+ * @param image Set to the image
+ * @return True if successful and false otherwise
+ */
+bool read_tiled(string filename, Image& image) {
+    TiledFile tiled;
+    if (!open_tiled(filename, tiled)) {
+        return false;
+    }
+    bool ok = read_tiled_region(tiled, 0, 0, tiled.height, tiled.width, image);
+    close_tiled(tiled);
+    return ok;
+}
+
+/**
+ * Rotates a tiled file into a new tiled file one output tile at a time, so only a few tiles of
+ * either image are ever held in memory
+ * @param input The tiled file to rotate
+ * @param output The rotated tiled file, using the same tile size
+ * @param rotations The number of 90 degree rotations, in the same direction as rotate_90()
+ * @param compress True to store uniform tiles as a single pixel and LZ compress the others
+ * @return True if successful and false otherwise
+ */
+bool rotate_tiled(string input, string output, int rotations, bool compress) {
+    TiledFile tiled;
+    if (!open_tiled(input, tiled)) {
+        return false;
+    }
+    rotations = rotations % 4;
+    int rows = tiled.height, cols = tiled.width;
+    int new_rows = rotations % 2 == 0 ? rows : cols;
+    int new_cols = rotations % 2 == 0 ? cols : rows;
+    bool ok = true;
+    Image region;
+    bool written = write_tiles(output, new_cols, new_rows, tiled.tile_size,
+        [&](int, int top, int left, int bottom, int right, vector<unsigned char>& tile) {
+            // The source rectangle that lands on this output tile
+            int src_top, src_left, src_rows, src_cols;
+            if (rotations == 1) {
+                src_top = left; src_left = cols - bottom; src_rows = right - left; src_cols = bottom - top;
+            } else if (rotations == 2) {
+                src_top = rows - bottom; src_left = cols - right; src_rows = bottom - top; src_cols = right - left;
+            } else if (rotations == 3) {
+                src_top = rows - right; src_left = top; src_rows = right - left; src_cols = bottom - top;
+            } else {
+                src_top = top; src_left = left; src_rows = bottom - top; src_cols = right - left;
+            }
+            if (!read_tiled_region(tiled, src_top, src_left, src_rows, src_cols, region)) {
+                ok = false;
+            }
+            Image rotated = rotate_90(region, rotations);
+            return encode_tile(rotated, 0, 0, bottom - top, right - left, compress, tile);
+        });
+    close_tiled(tiled);
+    return ok && written;
+}
+
+//**************************************************************************************************//
+//                                       UI functions                                               //
+//**************************************************************************************************//
+
+string get_input_filename() {
+    cout << "Enter input BMP filename: ";
+    string input;
+    cin >> input;
+    return input;
+}
+
+string get_output_filename() {
+    cout << "Enter output BMP filename: ";
+    string input;
+    cin >> input;
+    return input;
+}
+
+
+void print_menu(string& current_file) {
+    cout << endl;
+    cout << "IMAGE PROCESSING MENU" << endl;
+    cout << " 1) Vignette" << endl;
+    cout << " 2) Clarendon" << endl;
+    cout << " 3) Grayscale" << endl;
+    cout << " 4) Rotate 90 degrees" << endl;
+    cout << " 5) Rotate multiple 90 degrees" << endl;
+    cout << " 6) Enlarge" << endl;
+    cout << " 7) High contrast" << endl;
+    cout << " 8) Lighten" << endl;
+    cout << " 9) Darken" << endl;
+    cout << "10) Black, white, red, green, blue" << endl;
+    cout << "11) Change image (current: " << current_file << ")" << endl;
+    cout << "12) Process image sequence" << endl;
+    cout << "13) Gallery (several filters from one read)" << endl;
+    cout << endl;
+    cout << "Enter menu selection (Q/q to quit): ";
+}
+
+//**************************************************************************************************//
+//                                       Pipeline Helpers                                           //
+//**************************************************************************************************//
+
+// Fixed size queue for handing work between threads; push blocks while full, pop while empty
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    void push(T item) {
+        unique_lock<mutex> guard(lock);
+        not_full.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(item);
+        not_empty.notify_one();
+    }
+
+    // Returns false once the queue has been closed and emptied
+    bool pop(T& item) {
+        unique_lock<mutex> guard(lock);
+        not_empty.wait(guard, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex lock;
+    condition_variable not_empty;
+    condition_variable not_full;
+};
+
+// Assumed cache line size; ring indices written by different threads are kept this far apart so
+// a producer and a consumer never invalidate each other's line
+const size_t CACHE_LINE = 64;
+
+// Contention and occupancy counters for a ring, shown in the reports
+struct RingStats
+{
+    atomic<long long> pushes;
+    // Items already waiting in the ring, summed over every push
+    atomic<long long> occupancy_sum;
+    atomic<long long> max_occupancy;
+    // Times a producer found the ring full or a consumer found it empty
+    atomic<long long> full_waits;
+    atomic<long long> empty_waits;
+    // Failed compare-and-swaps between threads racing for the same slot
+    atomic<long long> cas_retries;
+};
+
+void record_push(RingStats& stats, long long occupancy) {
+    stats.pushes.fetch_add(1, memory_order_relaxed);
+    stats.occupancy_sum.fetch_add(occupancy, memory_order_relaxed);
+    long long seen = stats.max_occupancy.load(memory_order_relaxed);
+    while (occupancy > seen && !stats.max_occupancy.compare_exchange_weak(seen, occupancy)) {
+    }
+}
+
+void print_ring_stats(string name, const RingStats& stats, size_t capacity) {
+    long long pushes = stats.pushes;
+    cout << name << " ring: " << pushes << " items, occupancy avg "
+         << (pushes > 0 ? (double)stats.occupancy_sum / pushes : 0.0) << " max " << stats.max_occupancy
+         << " of " << capacity << ", full waits " << stats.full_waits << ", empty waits "
+         << stats.empty_waits << ", CAS retries " << stats.cas_retries << endl;
+}
+
+// Waits a little longer each time it is called: spin, then yield, then sleep
+void backoff(int& attempt) {
+    attempt++;
+    if (attempt < 64) {
+        return;
+    } else if (attempt < 256) {
+        this_thread::yield();
+    } else {
+        this_thread::sleep_for(chrono::microseconds(50));
+    }
+}
+
+size_t ring_capacity(size_t wanted) {
+    size_t capacity = 2;
+    while (capacity < wanted) {
+        capacity = capacity * 2;
+    }
+    return capacity;
+}
+
+// Lock-free ring for exactly one producer thread and one consumer thread
+template <typename T>
+class SpscRing
+{
+public:
+    // Capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) : stats(), slots(ring_capacity(capacity)), mask(slots.size() - 1) {
+        head = 0;
+        tail = 0;
+        closed = false;
+    }
+
+    bool try_push(const T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t h = head.load(memory_order_acquire);
+        if (t - h > mask) {
+            return false;
+        }
+        slots[t & mask] = item;
+        tail.store(t + 1, memory_order_release);
+        record_push(stats, t - h);
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) {
+            return false;
+        }
+        item = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    void push(const T& item) {
+        int attempt = 0;
+        while (!try_push(item)) {
+            if (attempt == 0) {
+                stats.full_waits++;
+            }
+            backoff(attempt);
+        }
+    }
+
+    // Returns false once the ring has been closed and emptied
+    bool pop(T& item) {
+        int attempt = 0;
+        while (!try_pop(item)) {
+            if (closed.load(memory_order_acquire)) {
+                return try_pop(item);
+            }
+            if (attempt == 0) {
+                stats.empty_waits++;
+            }
+            backoff(attempt);
+        }
+        return true;
+    }
+
+    void close() {
+        closed.store(true, memory_order_release);
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+
+    RingStats stats;
+
+private:
+    vector<T> slots;
+    size_t mask;
+    // Written only by the consumer
+    alignas(CACHE_LINE) atomic<size_t> head;
+    // Written only by the producer
+    alignas(CACHE_LINE) atomic<size_t> tail;
+    alignas(CACHE_LINE) atomic<bool> closed;
+};
+
+// Lock-free ring for any number of producers and consumers. Each slot carries a sequence number
+// saying whether it is ready to be filled or emptied for the current lap around the ring.
+template <typename T>
+class MpmcRing
+{
+public:
+    // Capacity is rounded up to a power of two
+    explicit MpmcRing(size_t capacity) : stats(), slots(ring_capacity(capacity)), mask(slots.size() - 1) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            slots[i].sequence = i;
+        }
+        enqueue_pos = 0;
+        dequeue_pos = 0;
+        closed = false;
+    }
+
+    bool try_push(const T& item) {
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & mask];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+                stats.cas_retries.fetch_add(1, memory_order_relaxed);
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+        slot->item = item;
+        slot->sequence.store(pos + 1, memory_order_release);
+        long long waiting = (long long)pos - (long long)dequeue_pos.load(memory_order_relaxed);
+        record_push(stats, max(waiting, 0LL));
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & mask];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+                stats.cas_retries.fetch_add(1, memory_order_relaxed);
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+        item = slot->item;
+        slot->sequence.store(pos + mask + 1, memory_order_release);
+        return true;
+    }
+
+    void push(const T& item) {
+        int attempt = 0;
+        while (!try_push(item)) {
+            if (attempt == 0) {
+                stats.full_waits++;
+            }
+            backoff(attempt);
+        }
+    }
+
+    // Returns false once the ring has been closed and emptied
+    bool pop(T& item) {
+        int attempt = 0;
+        while (!try_pop(item)) {
+            if (closed.load(memory_order_acquire)) {
+                return try_pop(item);
+            }
+            if (attempt == 0) {
+                stats.empty_waits++;
+            }
+            backoff(attempt);
+        }
+        return true;
+    }
+
+    void close() {
+        closed.store(true, memory_order_release);
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+
+    RingStats stats;
+
+private:
+    struct Slot
+    {
+        atomic<size_t> sequence;
+        T item;
+    };
+
+    vector<Slot> slots;
+    size_t mask;
+    alignas(CACHE_LINE) atomic<size_t> enqueue_pos;
+    alignas(CACHE_LINE) atomic<size_t> dequeue_pos;
+    alignas(CACHE_LINE) atomic<bool> closed;
+};
+
+double elapsed_ms(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Number of finished images that can wait for the background writer before respond() blocks
+const int WRITE_QUEUE_SIZE = 4;
+
+// Writes images on a background thread so the menu does not wait for the disk. Results are
+// collected and shown by report() at the next prompt.
+class AsyncWriter
+{
+public:
+    explicit AsyncWriter(size_t capacity) : queue(capacity), started(false) {}
+
+    // Queues an image for writing, taking over its storage
+    void submit(string filename, string filter_name, Image& image) {
+        if (!started) {
+            worker = thread(&AsyncWriter::run, this);
+            started = true;
+        }
+        Job* job = new Job();
+        job->filename = filename;
+        job->filter_name = filter_name;
+        job->image.swap(image);
+        {
+            lock_guard<mutex> guard(lock);
+            pending.insert(filename);
+        }
+        queue.push(job);
+    }
+
+    // Blocks while the file has a write queued or in progress, so it is never read half written
+    void wait_for(string filename) {
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&] { return pending.count(filename) == 0; });
+    }
+
+    // Blocks until every queued write has finished
+    void flush() {
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [this] { return pending.empty(); });
+    }
+
+    // Prints the outcome of writes that finished since the last report
+    void report() {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < messages.size(); i++) {
+            cout << messages[i] << endl;
+        }
+        messages.clear();
+    }
+
+    // Finishes every queued write and stops the writer thread
+    void finish() {
+        if (started) {
+            queue.close();
+            worker.join();
+            started = false;
+        }
+        report();
+    }
+
+private:
+    struct Job
+    {
+        string filename;
+        string filter_name;
+        Image image;
+    };
+
+    void run() {
+        vector<unsigned char> buffer;
+        Job* job;
+        while (queue.pop(job)) {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            bool ok = write_image(job->filename, job->image, buffer);
+            double ms = elapsed_ms(start);
+            lock_guard<mutex> guard(lock);
+            if (ok) {
+                messages.push_back("Saved " + job->filter_name + " to " + job->filename
+                                   + " (" + to_string((int)ms) + " ms)");
+            } else {
+                messages.push_back("Could not write " + job->filename + "!");
+            }
+            pending.erase(pending.find(job->filename));
+            done.notify_all();
+            delete job;
+        }
+    }
+
+    BoundedQueue<Job*> queue;
+    thread worker;
+    bool started;
+    mutex lock;
+    condition_variable done;
+    multiset<string> pending;
+    vector<string> messages;
+};
+
+AsyncWriter background_writer(WRITE_QUEUE_SIZE);
+
+//**************************************************************************************************//
+//                                       Handler Helpers                                            //
+//**************************************************************************************************//
+
+Image get_image(string filename, string filter_name) {
+    cout << endl;
+    cout << filter_name <<" selected" << endl;
+    background_writer.wait_for(filename);
+    return read_image(filename);
+}
+
+void respond(string filter_name, Image& new_image) {
+    string output_file = get_output_filename();
+    background_writer.submit(output_file, filter_name, new_image);
+    cout << "Successfully applied " << filter_name << "! Saving in the background." << endl;
+}
+
+//**************************************************************************************************//
+//                                          Handler                                                 //
+//**************************************************************************************************//
+
+
+/**
+ * Perform the input process on the input filename and use the filter name in the output
+ * @param filename The BMP file name to save the image to
+ * @param filter_name The common name for the output of the process, such as 'clarendon'
+ * @param *process A pointer to a function for processing the image and returning the new image
+ * @void
+ */
+void execute(string filename, string filter_name, Process process) {
+    string upper = filter_name;
+    upper[0] = std::toupper(filter_name[0]);
+    Image image = get_image(filename, upper);
+    reset_engine_stats();
+    Image new_image = process(image);
+    respond(filter_name, new_image);
+    print_engine_stats();
+}
+
+//**************************************************************************************************//
+//                                       Sequence Mode                                              //
+//**************************************************************************************************//
+
+// Number of frames in flight: one decoding, one filtering, one encoding
+const int SEQUENCE_FRAMES = 3;
+
+// One frame moving through the sequence pipeline; its buffers are reused by later frames
+struct Frame
+{
+    string input_file;
+    string output_file;
+    // File contents while decoding, then the encoded output
+    vector<unsigned char> bytes;
+    Image image;
+    Image new_image;
+    bool valid;
+    double decode_ms;
+    double filter_ms;
+};
+
+/**
+ * Splits a frame file name such as frame_0001.bmp into its parts
+ * @param filename The frame file name
+ * @param prefix The text before the frame number ("frame_")
+ * @param number The frame number (1)
+ * @param digits The width of the frame number, including leading zeros (4)
+ * @param extension The text after the frame number (".bmp")
+ * @return True if the name contains a frame number and false otherwise
+ */
+bool split_frame_name(string filename, string& prefix, int& number, int& digits, string& extension) {
+    size_t dot = filename.rfind('.');
+    size_t end = dot == string::npos ? filename.size() : dot;
+    size_t begin = end;
+    while (begin > 0 && isdigit((unsigned char)filename[begin - 1])) {
+        begin--;
+    }
+    if (begin == end) {
+        return false;
+    }
+    prefix = filename.substr(0, begin);
+    number = atoi(filename.substr(begin, end - begin).c_str());
+    digits = end - begin;
+    extension = filename.substr(end);
+    return true;
+}
+
+string frame_name(string prefix, int number, int digits, string extension) {
+    string num = to_string(number);
+    while ((int)num.size() < digits) {
+        num = "0" + num;
+    }
+    return prefix + num + extension;
+}
+
+/**
+ * Runs one filter over every frame of a numbered sequence, starting at the given frame and
+ * stopping at the first missing frame. Frames must all share the first frame's header. Decoding,
+ * filtering and encoding run on separate threads so consecutive frames overlap.
+ * @param first_file The first frame, such as frame_0001.bmp
+ * @param output_prefix Output frames are named output_prefix + frame number + extension
+ * @param spec The filter to apply to every frame
+ * @return the number of frames written
+ */
+int process_sequence(string first_file, string output_prefix, const FilterSpec& spec) {
+    string prefix, extension;
+    int first, digits;
+    if (!split_frame_name(first_file, prefix, first, digits, extension)) {
+        cout << "Sequence frames must be numbered, such as frame_0001.bmp" << endl;
+        return 0;
+    }
+
+    // Small frames are filtered several at a time, one per core; large frames are instead split
+    // across cores by the tiled executor
+    BmpHeader probe;
+    int filter_workers = 1;
+    if (probe_image(first_file, probe) && (long long)probe.width * probe.height < PARALLEL_MIN_PIXELS) {
+        filter_workers = worker_count();
+    }
+
+    // Frames circulate from the free ring to the decoder, the filter workers, the encoder and
+    // back, so their buffers are reused. Settings, lookup tables and the vignette mask are built
+    // once and shared by every frame.
+    FilterState state = new_state(spec);
+    int frame_count = SEQUENCE_FRAMES + filter_workers - 1;
+    vector<Frame> frames(frame_count);
+    SpscRing<Frame*> free_frames(frame_count);
+    MpmcRing<Frame*> decoded(frame_count);
+    MpmcRing<Frame*> filtered(frame_count);
+    for (int i = 0; i < frame_count; i++) {
+        free_frames.push(&frames[i]);
+    }
+
+    reset_engine_stats();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long long pixels = 0;
+
+    // Decode stage: the first frame's header is validated, later frames only have to match it
+    thread decoder([&] {
+        unsigned char first_header[54];
+        BmpHeader header;
+        bool have_header = false;
+        for (int number = first; ; number++) {
+            Frame* frame = NULL;
+            free_frames.pop(frame);
+            chrono::steady_clock::time_point t = chrono::steady_clock::now();
+            frame->input_file = frame_name(prefix, number, digits, extension);
+            frame->output_file = frame_name(output_prefix, number, digits, extension);
+            if (!read_file(frame->input_file, frame->bytes)) {
+                break;
+            }
+            if (!have_header) {
+                have_header = parse_header(frame->bytes.data(), frame->bytes.size(), header);
+                if (have_header) {
+                    memcpy(first_header, frame->bytes.data(), sizeof(first_header));
+                }
+            }
+            frame->valid = have_header && frame->bytes.size() >= (size_t)header.file_size
+                && memcmp(first_header, frame->bytes.data(), sizeof(first_header)) == 0;
+            if (frame->valid) {
+                decode_pixels(frame->bytes.data(), header, frame->image);
+            }
+            frame->decode_ms = elapsed_ms(t);
+            decoded.push(frame);
+        }
+        decoded.close();
+    });
+
+    // Encode stage: writes each output reusing the frame's file buffer
+    int written = 0;
+    int skipped = 0;
+    double decode_ms = 0, filter_ms = 0, encode_ms = 0;
+    thread encoder([&] {
+        Frame* frame;
+        while (filtered.pop(frame)) {
+            if (frame->valid) {
+                chrono::steady_clock::time_point t = chrono::steady_clock::now();
+                if (write_image(frame->output_file, frame->new_image, frame->bytes)) {
+                    written++;
+                    pixels += (long long)frame->image.size() * frame->image[0].size();
+                } else {
+                    cout << "Could not write " << frame->output_file << endl;
+                    skipped++;
+                }
+                decode_ms += frame->decode_ms;
+                filter_ms += frame->filter_ms;
+                encode_ms += elapsed_ms(t);
+            } else {
+                cout << "Skipping " << frame->input_file << ": header differs from the first frame" << endl;
+                skipped++;
+            }
+            free_frames.push(frame);
+        }
+    });
+
+    // Filter stage, each worker with its own copy of the filter state
+    auto filter_worker = [&] {
+        FilterState worker_state = state;
+        Frame* frame;
+        while (decoded.pop(frame)) {
+            if (frame->valid) {
+                chrono::steady_clock::time_point t = chrono::steady_clock::now();
+                run_filter(frame->image, frame->new_image, worker_state);
+                frame->filter_ms = elapsed_ms(t);
+            }
+            filtered.push(frame);
+        }
+    };
+    vector<thread> filter_threads;
+    for (int i = 1; i < filter_workers; i++) {
+        filter_threads.push_back(thread(filter_worker));
+    }
+    filter_worker();
+    for (size_t i = 0; i < filter_threads.size(); i++) {
+        filter_threads[i].join();
+    }
+    filtered.close();
+    decoder.join();
+    encoder.join();
+
+    double seconds = elapsed_ms(start) / 1000.0;
+    cout << endl;
+    cout << "Sequence: " << written << " frames written, " << skipped << " skipped" << endl;
+    if (written > 0) {
+        cout << "Time: " << seconds << " s, " << written / seconds << " frames/sec, "
+             << pixels / seconds / 1e6 << " MP/s" << endl;
+        cout << "Per frame: decode " << decode_ms / written << " ms, filter " << filter_ms / written
+             << " ms, encode " << encode_ms / written << " ms" << endl;
+    }
+    cout << "Filter workers: " << filter_workers << endl;
+    print_ring_stats("Free", free_frames.stats, free_frames.capacity());
+    print_ring_stats("Decoded", decoded.stats, decoded.capacity());
+    print_ring_stats("Filtered", filtered.stats, filtered.capacity());
+    print_engine_stats();
+    return written;
+}
+
+void run_sequence() {
+    cout << "Process image sequence selected" << endl;
+    background_writer.flush();
+    cout << "Enter first frame filename (such as frame_0001.bmp): ";
+    string first_file;
+    cin >> first_file;
+    int selection = 0;
+    while (selection < 1 || selection > 10) {
+        selection = get_positive_int("Enter filter to apply to every frame (1-10): ");
+    }
+    FilterSpec spec = get_filter_spec(selection);
+    cout << "Enter output prefix (such as out_): ";
+    string output_prefix;
+    cin >> output_prefix;
+    process_sequence(first_file, output_prefix, spec);
+}
+
+//**************************************************************************************************//
+//                                          Gallery                                                 //
+//**************************************************************************************************//
+
+/**
+ * Decodes an image once and saves the output of several filters, run together by fan_out()
+ * @param filename The BMP file to filter
+ * @param output_prefix Each output is named output_prefix + spec_label() + ".bmp"
+ * @param specs The filters to run
+ * @return True if the image could be read and false otherwise
+ */
+bool run_gallery(string filename, string output_prefix, const vector<FilterSpec>& specs) {
+    background_writer.wait_for(filename);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Image image = read_image(filename);
+    if (image.empty()) {
+        cout << filename << " is not a valid BMP image" << endl;
+        return false;
+    }
+    double decode_ms = elapsed_ms(start);
+
+    vector<FilterState> states;
+    for (size_t i = 0; i < specs.size(); i++) {
+        states.push_back(new_state(specs[i]));
+    }
+    vector<Image> outputs;
+    start = chrono::steady_clock::now();
+    fan_out(image, states, outputs);
+    double filter_ms = elapsed_ms(start);
+
+    for (size_t i = 0; i < specs.size(); i++) {
+        string label = spec_label(specs[i]);
+        background_writer.submit(output_prefix + label + ".bmp", label, outputs[i]);
+    }
+    cout << "Applied " << specs.size() << " filters: decode " << decode_ms << " ms, filters "
+         << filter_ms << " ms. Saving in the background." << endl;
+    return true;
+}
+
+void gallery(string current_file) {
+    cout << "Gallery selected" << endl;
+    cout << "Enter filters to apply followed by 0 (such as 1 3 7 0, or just 0 for all): ";
+    vector<int> selections;
+    int selection;
+    while (cin >> selection && selection != 0) {
+        if (selection >= 1 && selection <= 10) {
+            selections.push_back(selection);
+        }
+    }
+    if (selections.empty()) {
+        for (int i = 1; i <= 10; i++) {
+            selections.push_back(i);
+        }
+    }
+    vector<FilterSpec> specs;
+    for (size_t i = 0; i < selections.size(); i++) {
+        cout << spec_names[selections[i] - 1] << ":" << endl;
+        specs.push_back(get_filter_spec(selections[i]));
+    }
+    cout << "Enter output prefix (such as gallery_): ";
+    string output_prefix;
+    cin >> output_prefix;
+    run_gallery(current_file, output_prefix, specs);
+}
+
+//**************************************************************************************************//
+//                                       Contact Sheet                                              //
+//**************************************************************************************************//
+
+// Grey behind and between the cells of a contact sheet
+const unsigned char SHEET_BACKGROUND = 48;
+// Cell side in pixels when none is given
+const int SHEET_CELL = 256;
+// Sheets with more pixel bytes than this are built and written a row of cells at a time
+const size_t SHEET_STREAM_BYTES = 256 << 20;
+
+// Where the cells of a contact sheet are: columns of square cells with a gap around each
+struct SheetLayout
+{
+    int cells;
+    int cell_side;
+    int columns;
+    int cell_rows;
+    int gap;
+    int width;
+    int height;
+    size_t row_bytes;
+};
+
+/**
+ * Lays out a contact sheet
+ * @param cells The number of cells
+ * @param cell_side The side of each cell in pixels
+ * @param columns Cells per row, or 0 to make the sheet about square
+ * @param layout Set to the layout
+ * @return True if the sheet fits in a BMP file and false otherwise
+ */
+bool new_sheet_layout(int cells, int cell_side, int columns, SheetLayout& layout) {
+    layout.cells = cells;
+    layout.cell_side = cell_side;
+    layout.columns = columns > 0 ? min(columns, cells) : (int)ceil(sqrt((double)cells));
+    layout.cell_rows = (cells + layout.columns - 1) / layout.columns;
+    layout.gap = max(2, cell_side / 32);
+    // In 64 bits, so a large cell cannot wrap the sheet round to a size that looks valid
+    long long pitch = (long long)cell_side + layout.gap;
+    long long width = layout.columns * pitch + layout.gap;
+    long long height = layout.cell_rows * pitch + layout.gap;
+    if (!bmp_fits(width, height)) {
+        return false;
+    }
+    layout.width = width;
+    layout.height = height;
+    layout.row_bytes = ((size_t)layout.width * 3 + 3) & ~(size_t)3;
+    return true;
+}
+
+// Fills one cell of a sheet. origin points at the bytes of the cell's top left pixel, encoded
+// blue first, and each row down is stride bytes on. Returns false if the cell was left blank.
+typedef function<bool(int cell, unsigned char* origin, ptrdiff_t stride)> CellPainter;
+
+/**
+ * Downscales an image straight into a sheet cell, averaging the source pixels under each
+ * thumbnail pixel. The thumbnail keeps the image's shape and is centered in the cell; images
+ * smaller than the cell are not enlarged. Each source row is read once, run through the filter
+ * if there is one, and added to the sums of the thumbnail row it falls in.
+ * @param image The image to downscale
+ * @param state A point-wise filter to apply on the way, with any vignette mask built, or NULL
+ * @param cell_side The side of the cell in pixels
+ * @param origin The bytes of the cell's top left pixel
+ * @param stride The bytes from one row of the cell to the next one down
+ * @return nothing
+ */
+void downscale_into(const Image& image, const FilterState* state, int cell_side, unsigned char* origin,
+                    ptrdiff_t stride) {
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    int thumb_rows = min(rows, cell_side);
+    int thumb_cols = min(cols, cell_side);
+    if (rows >= cols) {
+        thumb_cols = max(1, (int)((long long)cols * thumb_rows / rows));
+    } else {
+        thumb_rows = max(1, (int)((long long)rows * thumb_cols / cols));
+    }
+    origin = origin + (cell_side - thumb_rows) / 2 * stride + (cell_side - thumb_cols) / 2 * 3;
+
+    vector<int> column_of(cols);
+    vector<int> widths(thumb_cols, 0);
+    for (int col = 0; col < cols; col++) {
+        column_of[col] = (long long)col * thumb_cols / cols;
+        widths[column_of[col]]++;
+    }
+    vector<uint64_t> sums(thumb_cols * 3);
+    vector<Pixel> filtered(state ? cols : 0);
+    int row = 0;
+    for (int thumb_row = 0; thumb_row < thumb_rows; thumb_row++) {
+        int end = (long long)(thumb_row + 1) * rows / thumb_rows;
+        int height = end - row;
+        fill(sums.begin(), sums.end(), 0);
+        for (; row < end; row++) {
+            const Pixel* src = image[row].data();
+            if (state) {
+                filter_row(*state, src, filtered.data(), row, cols);
+                src = filtered.data();
+            }
+            for (int col = 0; col < cols; col++) {
+                uint64_t* sum = &sums[column_of[col] * 3];
+                sum[0] += src[col].blue;
+                sum[1] += src[col].green;
+                sum[2] += src[col].red;
+            }
+        }
+        unsigned char* dst = origin + thumb_row * stride;
+        for (int k = 0; k < thumb_cols * 3; k++) {
+            uint64_t area = (uint64_t)widths[k / 3] * height;
+            dst[k] = (sums[k] + area / 2) / area;
+        }
+    }
+}
+
+/**
+ * Builds a contact sheet and saves it as a BMP file. The cells of a band are painted in
+ * parallel straight into the band's encoded bytes, which are then written at their place in
+ * the file. A band is the whole sheet unless streaming, when it is one row of cells.
+ * @param filename The BMP file to save the sheet to, written to a temporary file renamed into place
+ * @param layout Where the cells are
+ * @param stream True to build the sheet a row of cells at a time
+ * @param paint Fills each cell
+ * @param blank Set to the number of cells left blank
+ * @return True if the sheet was saved and false otherwise
+ */
+bool write_sheet(string filename, const SheetLayout& layout, bool stream, CellPainter paint, int& blank) {
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    set_bmp_headers(header, layout.width, layout.height);
+    string temp = temp_name(filename);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = pwrite(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    int pitch = layout.cell_side + layout.gap;
+    int band_cell_rows = stream ? 1 : layout.cell_rows;
+    vector<unsigned char> band;
+    atomic<int> blank_cells(0);
+    for (int first_row = 0; ok && first_row < layout.cell_rows; first_row += band_cell_rows) {
+        int last_row = min(first_row + band_cell_rows, layout.cell_rows);
+        // Sheet rows [top, bottom); the last band also takes the gap below the last cells
+        int top = first_row * pitch;
+        int bottom = last_row == layout.cell_rows ? layout.height : last_row * pitch;
+        band.assign((size_t)(bottom - top) * layout.row_bytes, 0);
+        for (int y = top; y < bottom; y++) {
+            memset(band.data() + (size_t)(y - top) * layout.row_bytes, SHEET_BACKGROUND, layout.width * 3);
+        }
+
+        int first_cell = first_row * layout.columns;
+        int last_cell = min(last_row * layout.columns, layout.cells);
+        atomic<int> next_cell(first_cell);
+        int workers = min(worker_count(), last_cell - first_cell);
+        // Cells are painted side by side, so the filters of each one only get the cores left over
+        int threads_per_cell = max(1, worker_count() / max(workers, 1));
+        auto worker = [&] {
+            int outer_threads = image_threads;
+            image_threads = threads_per_cell;
+            for (int cell = next_cell++; cell < last_cell; cell = next_cell++) {
+                int y = layout.gap + cell / layout.columns * pitch;
+                int x = layout.gap + cell % layout.columns * pitch;
+                // Rows are stored bottom to top, so going down the cell goes back through the band
+                unsigned char* origin = band.data() + (size_t)(bottom - 1 - y) * layout.row_bytes + (size_t)x * 3;
+                if (!paint(cell, origin, -(ptrdiff_t)layout.row_bytes)) {
+                    blank_cells++;
+                }
+            }
+            image_threads = outer_threads;
+        };
+        vector<thread> threads;
+        for (int i = 1; i < workers; i++) {
+            threads.push_back(thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        off_t offset = sizeof(header) + (off_t)(layout.height - bottom) * layout.row_bytes;
+        ok = pwrite(fd, band.data(), band.size(), offset) == (ssize_t)band.size();
+    }
+    blank = blank_cells;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Builds a contact sheet of many images, each run through a chain of filters. When the last
+ * filter is point-wise it is applied while downscaling, so no filtered full-size copy is made.
+ * @param files The BMP files, one per cell
+ * @param output The BMP file to save the sheet to
+ * @param chain The filters to apply to each image
+ * @param cell_side The side of each cell in pixels
+ * @param columns Cells per row, or 0 to make the sheet about square
+ * @param stream True to build the sheet a row of cells at a time, which huge sheets always are
+ * @return True if the sheet was saved and false otherwise
+ */
+bool run_contact_sheet(const vector<string>& files, string output, const vector<FilterSpec>& chain, int cell_side,
+                       int columns, bool stream) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SheetLayout layout;
+    if (!new_sheet_layout(files.size(), cell_side, columns, layout)) {
+        cerr << "A sheet of " << files.size() << " cells of " << cell_side
+             << " pixels is too large for a BMP file" << endl;
+        return false;
+    }
+    stream = stream || layout.row_bytes * layout.height > SHEET_STREAM_BYTES;
+    bool fuse_last = !chain.empty() && point_wise(chain.back().selection);
+    CellPainter paint = [&](int cell, unsigned char* origin, ptrdiff_t stride) {
+        Image image, new_image;
+        vector<unsigned char> buffer;
+        if (!read_image(files[cell], image, buffer)) {
+            cerr << files[cell] << " is not a valid BMP image" << endl;
+            return false;
+        }
+        vector<FilterState> states;
+        for (size_t k = 0; k < chain.size(); k++) {
+            states.push_back(new_state(chain[k]));
+        }
+        size_t staged = fuse_last ? chain.size() - 1 : chain.size();
+        for (size_t k = 0; k < staged; k++) {
+            run_filter(image, new_image, states[k]);
+            swap(image, new_image);
+        }
+        FilterState* last = fuse_last ? &states.back() : NULL;
+        if (last && last->spec.selection == 1) {
+            build_vignette_mask(*last, image.size(), image[0].size());
+        }
+        downscale_into(image, last, cell_side, origin, stride);
+        return true;
+    };
+    int blank = 0;
+    if (!write_sheet(output, layout, stream, paint, blank)) {
+        cerr << "Could not write " << output << endl;
+        return false;
+    }
+    cout << "Sheet: " << layout.cells << " cells in " << layout.width << "x" << layout.height << ", "
+         << elapsed_ms(start) << " ms" << (stream ? ", streamed" : "");
+    if (blank > 0) {
+        cout << ", " << blank << " left blank";
+    }
+    cout << endl;
+    return true;
+}
+
+//**************************************************************************************************//
+//                                           Sweep                                                  //
+//**************************************************************************************************//
+
+// Most variants a sweep may produce
+const int SWEEP_MAX_VARIANTS = 1000;
+
+/**
+ * Reads a sweep such as lighten:0.1..0.9:0.05, one variant per value from the first to the
+ * last in steps (0.1 if left out). Clarendon, lighten and darken can be swept; any other
+ * point-wise filter, such as greyscale, is a single variant.
+ * @param text The sweep
+ * @param specs The variants are added here
+ * @return True if the sweep is valid and false otherwise
+ */
+bool parse_sweep(string text, vector<FilterSpec>& specs) {
+    size_t dots = text.find("..");
+    FilterSpec spec;
+    if (dots == string::npos) {
+        if (!parse_filter_spec(text, spec) || !point_wise(spec.selection)) {
+            return false;
+        }
+        specs.push_back(spec);
+        return true;
+    }
+    size_t colon = text.find(':');
+    if (colon == string::npos || colon > dots || !parse_filter_spec(text.substr(0, colon), spec)
+        || (spec.selection != 2 && spec.selection != 8 && spec.selection != 9)) {
+        return false;
+    }
+    string to_text = text.substr(dots + 2);
+    size_t step_colon = to_text.find(':');
+    double from = atof(text.substr(colon + 1, dots - colon - 1).c_str());
+    double to = atof(to_text.substr(0, step_colon).c_str());
+    double step = step_colon == string::npos ? 0.1 : atof(to_text.substr(step_colon + 1).c_str());
+    if (from <= 0.0 || to > 1.0 || from > to || step <= 0.0 || (to - from) / step >= SWEEP_MAX_VARIANTS) {
+        return false;
+    }
+    // Values are rounded so that steps like 0.05 give labels like lighten_0.15
+    for (int k = 0; from + k * step <= to + step * 1e-6; k++) {
+        spec.scale = round((from + k * step) * 1e6) / 1e6;
+        specs.push_back(spec);
+    }
+    return true;
+}
+
+/**
+ * Filters rows [top, bottom) of an image and encodes them as BMP pixel array bytes, bottom row first
+ * @param image The input image
+ * @param state A point-wise filter, with any vignette mask built
+ * @param top, bottom The rows of the band
+ * @param row_bytes The bytes in each encoded row, including padding
+ * @param filtered Scratch space for one row
+ * @param dst The encoded band
+ * @return nothing
+ */
+void encode_band(const Image& image, const FilterState& state, int top, int bottom, size_t row_bytes,
+                 vector<Pixel>& filtered, unsigned char* dst) {
+    int cols = image[0].size();
+    for (int row = top; row < bottom; row++) {
+        filter_row(state, image[row].data(), filtered.data(), row, cols);
+        encode_row(filtered.data(), cols, dst + (bottom - 1 - row) * row_bytes);
+    }
+}
+
+/**
+ * Renders many variants of one image in a single pass. The image is decoded once and every
+ * variant's tables are built up front. Workers then take bands of rows: each source row is
+ * read from memory once and filtered into every variant while it is in cache, and each
+ * variant's encoded band is written straight to its place in the variant's file.
+ * @param filename The BMP file to sweep
+ * @param output_prefix Each variant is saved as output_prefix + spec_label() + ".bmp"
+ * @param specs The variants, all point-wise filters
+ * @param sheet If not empty, a contact sheet of the variants is also saved to this file
+ * @return True if every variant was saved and false otherwise
+ */
+bool run_sweep(string filename, string output_prefix, vector<FilterSpec> specs, string sheet) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Image image = read_image(filename);
+    if (image.empty()) {
+        cerr << filename << " is not a valid BMP image" << endl;
+        return false;
+    }
+    double decode_ms = elapsed_ms(start);
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    size_t variants = specs.size();
+    vector<FilterState> states;
+    for (size_t k = 0; k < variants; k++) {
+        states.push_back(new_state(specs[k]));
+        if (specs[k].selection == 1) {
+            build_vignette_mask(states[k], rows, cols);
+        }
+    }
+
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    size_t row_bytes = set_bmp_headers(header, cols, rows);
+    vector<int> fds(variants, -1);
+    vector<string> names(variants);
+    bool ok = true;
+    for (size_t k = 0; k < variants; k++) {
+        names[k] = output_prefix + spec_label(specs[k]) + ".bmp";
+        fds[k] = open(temp_name(names[k]).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = ok && fds[k] >= 0 && pwrite(fds[k], header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    }
+
+    int band = band_rows;
+    int bands = (rows + band - 1) / band;
+    atomic<int> next_band(0);
+    atomic<bool> failed(!ok);
+    auto worker = [&] {
+        vector<Pixel> filtered(cols);
+        // The band of every variant, in file order: bottom row first, with row padding zeroed
+        vector<unsigned char> band_bytes(band * row_bytes, 0);
+        for (int b = next_band++; b < bands && !failed; b = next_band++) {
+            int top = b * band;
+            int bottom = min(top + band, rows);
+            size_t offset = sizeof(header) + (size_t)(rows - bottom) * row_bytes;
+            size_t size = (bottom - top) * row_bytes;
+            for (size_t k = 0; k < variants; k++) {
+                encode_band(image, states[k], top, bottom, row_bytes, filtered, band_bytes.data());
+                if (pwrite(fds[k], band_bytes.data(), size, offset) != (ssize_t)size) {
+                    failed = true;
+                }
+            }
+        }
+    };
+    long long work = (long long)rows * cols * variants;
+    int workers = work < PARALLEL_MIN_PIXELS ? 1 : min(worker_count(), bands);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    ok = !failed;
+    for (size_t k = 0; k < variants; k++) {
+        string temp = temp_name(names[k]);
+        if (fds[k] >= 0) {
+            ok = close(fds[k]) == 0 && ok;
+        }
+        if (!ok || rename(temp.c_str(), names[k].c_str()) != 0) {
+            unlink(temp.c_str());
+            ok = false;
+        }
+    }
+    if (!ok) {
+        cerr << "Could not write the sweep outputs" << endl;
+        return false;
+    }
+    double total_ms = elapsed_ms(start);
+    double mb = (double)variants * (sizeof(header) + rows * row_bytes) / 1e6;
+    cout << "Sweep: " << variants << " variants of " << cols << "x" << rows << " in " << total_ms
+         << " ms (decode " << decode_ms << " ms), " << mb / ((total_ms - decode_ms) / 1000) << " MB/s written" << endl;
+    if (sheet.empty()) {
+        return true;
+    }
+    // The sheet filters the decoded image again while downscaling rather than keeping the variants
+    start = chrono::steady_clock::now();
+    SheetLayout layout;
+    if (!new_sheet_layout(variants, SHEET_CELL, 0, layout)) {
+        cerr << "A sheet of " << variants << " cells is too large for a BMP file" << endl;
+        return false;
+    }
+    CellPainter paint = [&](int cell, unsigned char* origin, ptrdiff_t stride) {
+        downscale_into(image, &states[cell], layout.cell_side, origin, stride);
+        return true;
+    };
+    int blank = 0;
+    if (!write_sheet(sheet, layout, layout.row_bytes * layout.height > SHEET_STREAM_BYTES, paint, blank)) {
+        cerr << "Could not write " << sheet << endl;
+        return false;
+    }
+    cout << "Sheet: " << variants << " cells in " << layout.width << "x" << layout.height << ", "
+         << elapsed_ms(start) << " ms" << endl;
+    return true;
+}
+
+//**************************************************************************************************//
+//                                          Corpus                                                  //
+//**************************************************************************************************//
+
+// Kinds of synthetic image, each showing the engine a different case: smooth content, content
+// that does not compress, natural-looking content, large uniform areas, and few or many colors
+const int CORPUS_KINDS = 6;
+const string corpus_kind_names[CORPUS_KINDS] = {"gradient", "noise", "spectrum", "border", "few", "many"};
+// Octaves of value noise summed for the spectrum kind, each half the size and amplitude of the last
+const int SPECTRUM_OCTAVES = 6;
+// Side in pixels of the single-colored patches of the few kind
+const int FEW_PATCH = 64;
+
+// A synthetic image, the same pixels every time for the same settings
+struct CorpusSpec
+{
+    int kind;
+    int width;
+    int height;
+    uint64_t seed;
+};
+
+// Mixes a seed and a position into 64 well spread bits
+uint64_t corpus_hash(uint64_t seed, uint64_t x, uint64_t y) {
+    uint64_t h = seed ^ (x * HASH_PRIME_1) ^ (y * HASH_PRIME_2);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// Noise between 0 and 1 that varies smoothly between lattice points `scale` pixels apart
+double value_noise(uint64_t seed, double x, double y, double scale) {
+    double fx = x / scale, fy = y / scale;
+    uint64_t x0 = (uint64_t)fx, y0 = (uint64_t)fy;
+    double tx = fx - x0, ty = fy - y0;
+    tx = tx * tx * (3 - 2 * tx);
+    ty = ty * ty * (3 - 2 * ty);
+    const double unit = 1.0 / 18446744073709551616.0;
+    double a = corpus_hash(seed, x0, y0) * unit, b = corpus_hash(seed, x0 + 1, y0) * unit;
+    double c = corpus_hash(seed, x0, y0 + 1) * unit, d = corpus_hash(seed, x0 + 1, y0 + 1) * unit;
+    return (a + (b - a) * tx) * (1 - ty) + (c + (d - c) * tx) * ty;
+}
+
+/**
+ * Generates one row of a synthetic image. Every pixel depends only on the settings and its
+ * position, so rows can be generated in any order on any thread.
+ * @param spec The image
+ * @param y The row, counting from the top
+ * @param row Set to the row's pixels
+ * @return nothing
+ */
+void generate_row(const CorpusSpec& spec, int y, Pixel* row) {
+    int width = spec.width, height = spec.height;
+    for (int x = 0; x < width; x++) {
+        Pixel& p = row[x];
+        switch (spec.kind) {
+            case 0:
+                p.red = (long long)x * 255 / max(width - 1, 1);
+                p.green = (long long)y * 255 / max(height - 1, 1);
+                p.blue = ((long long)x + y) * 255 / max(width + height - 2, 1);
+                break;
+            case 1: {
+                uint64_t h = corpus_hash(spec.seed, x, y);
+                p.red = h & 255;
+                p.green = (h >> 8) & 255;
+                p.blue = (h >> 16) & 255;
+                break;
+            }
+            case 2: {
+                // Amplitude falling with frequency gives the 1/f spectrum of photographs;
+                // a coarse second noise tints it
+                double sum = 0, amplitude = 0.5, scale = max(width, height) / 4.0;
+                for (int octave = 0; octave < SPECTRUM_OCTAVES && scale >= 1; octave++) {
+                    sum += amplitude * value_noise(spec.seed + octave, x, y, scale);
+                    amplitude = amplitude / 2;
+                    scale = scale / 2;
+                }
+                double tint = value_noise(spec.seed ^ HASH_PRIME_3, x, y, max(width, height) / 2.0) - 0.5;
+                double light = min(sum / (1 - amplitude * 2), 1.0) * 255;
+                p.red = max(0.0, min(255.0, light * (1 + tint)));
+                p.green = light;
+                p.blue = max(0.0, min(255.0, light * (1 - tint)));
+                break;
+            }
+            case 3: {
+                // A uniform frame a quarter of each side wide around a gradient
+                bool inside = x >= width / 4 && x < width - width / 4 && y >= height / 4 && y < height - height / 4;
+                p.red = inside ? (long long)x * 255 / max(width - 1, 1) : 40;
+                p.green = inside ? (long long)y * 255 / max(height - 1, 1) : 90;
+                p.blue = inside ? 128 : 160;
+                break;
+            }
+            case 4: {
+                uint64_t h = corpus_hash(spec.seed, x / FEW_PATCH, y / FEW_PATCH) % 8;
+                p.red = h & 1 ? 230 : 20;
+                p.green = h & 2 ? 200 : 40;
+                p.blue = h & 4 ? 210 : 30;
+                break;
+            }
+            default: {
+                // Consecutive pixels count through every 24 bit color
+                uint64_t index = (uint64_t)y * width + x + spec.seed;
+                p.red = index & 255;
+                p.green = (index >> 8) & 255;
+                p.blue = (index >> 16) & 255;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Reads a synthetic image description: KIND:SIZE[:SEED], where SIZE is WIDTHxHEIGHT or a
+ * number of megapixels or gigapixels such as 16MP or 1GP, laid out 4:3
+ * @param text The description
+ * @param spec Set to the image
+ * @return True if the description is valid and false otherwise
+ */
+bool parse_corpus_spec(string text, CorpusSpec& spec) {
+    size_t colon = text.find(':');
+    if (colon == string::npos) {
+        return false;
+    }
+    string kind = text.substr(0, colon), size = text.substr(colon + 1);
+    size_t seed_colon = size.find(':');
+    spec.seed = seed_colon == string::npos ? 1 : strtoull(size.substr(seed_colon + 1).c_str(), NULL, 10);
+    size = size.substr(0, seed_colon);
+    spec.kind = find(corpus_kind_names, corpus_kind_names + CORPUS_KINDS, kind) - corpus_kind_names;
+    size_t x = size.find('x');
+    double pixels = atof(size.c_str());
+    long long width, height;
+    if (x != string::npos) {
+        width = atoll(size.c_str());
+        height = atoll(size.substr(x + 1).c_str());
+    } else if (size.size() > 2 && (size.substr(size.size() - 2) == "MP" || size.substr(size.size() - 2) == "GP")) {
+        pixels = pixels * (size[size.size() - 2] == 'G' ? 1e9 : 1e6);
+        // More than a BMP file can hold in any shape; also keeps the conversions below in range
+        if (!(pixels > 0 && pixels < 1e10)) {
+            return false;
+        }
+        width = llround(sqrt(pixels * 4 / 3));
+        height = llround(pixels / max(width, 1LL));
+    } else {
+        return false;
+    }
+    // BMP file sizes are unsigned 32 bit numbers of bytes, which 1.4 GP of 24 bit pixels fill
+    if (spec.kind >= CORPUS_KINDS || !bmp_fits(width, height)) {
+        return false;
+    }
+    spec.width = width;
+    spec.height = height;
+    return true;
+}
+
+string corpus_name(const CorpusSpec& spec) {
+    return corpus_kind_names[spec.kind] + "_" + to_string(spec.width) + "x" + to_string(spec.height)
+        + (spec.seed == 1 ? "" : "_" + to_string(spec.seed)) + ".bmp";
+}
+
+// Generates a synthetic image in memory, splitting the rows across worker threads
+Image generate_image(const CorpusSpec& spec) {
+    Image image(spec.height, vector<Pixel> (spec.width));
+    atomic<int> next_row(0);
+    auto worker = [&] {
+        for (int y = next_row++; y < spec.height; y = next_row++) {
+            generate_row(spec, y, image[y].data());
+        }
+    };
+    int workers = (long long)spec.width * spec.height < PARALLEL_MIN_PIXELS ? 1 : worker_count();
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    return image;
+}
+
+/**
+ * Writes a synthetic image as a BMP file without holding it in memory. Workers take bands of
+ * rows, generate and encode them, and write each band straight to its place in the file, so
+ * a gigapixel image needs only a band per worker.
+ * @param filename The BMP file, written to a temporary file renamed into place
+ * @param spec The image
+ * @return True if the file was saved and false otherwise
+ */
+bool write_corpus_image(string filename, const CorpusSpec& spec) {
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    size_t row_bytes = set_bmp_headers(header, spec.width, spec.height);
+    string temp = temp_name(filename);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    atomic<bool> failed(pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header));
+    int band = band_rows;
+    int bands = (spec.height + band - 1) / band;
+    atomic<int> next_band(0);
+    auto worker = [&] {
+        vector<Pixel> row(spec.width);
+        // Rows in file order, bottom first, with the padding zeroed
+        vector<unsigned char> band_bytes(band * row_bytes, 0);
+        for (int b = next_band++; b < bands && !failed; b = next_band++) {
+            int top = b * band;
+            int bottom = min(top + band, spec.height);
+            for (int y = top; y < bottom; y++) {
+                generate_row(spec, y, row.data());
+                encode_row(row.data(), spec.width, band_bytes.data() + (bottom - 1 - y) * row_bytes);
+            }
+            size_t size = (bottom - top) * row_bytes;
+            off_t offset = sizeof(header) + (off_t)(spec.height - bottom) * row_bytes;
+            if (pwrite(fd, band_bytes.data(), size, offset) != (ssize_t)size) {
+                failed = true;
+            }
+        }
+    };
+    int workers = min(worker_count(), bands);
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    bool ok = close(fd) == 0 && !failed;
+    if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes a corpus of synthetic images to a directory, skipping files already there at the
+ * right size so a corpus can be asked for again cheaply
+ * @param out_dir The directory
+ * @param specs The images
+ * @return the number of images that could not be written
+ */
+int run_gen(string out_dir, const vector<CorpusSpec>& specs) {
+    int failures = 0;
+    for (size_t i = 0; i < specs.size(); i++) {
+        string filename = out_dir + "/" + corpus_name(specs[i]);
+        size_t bytes = BMP_HEADER_SIZE + DIB_HEADER_SIZE + (((size_t)specs[i].width * 3 + 3) & ~(size_t)3) * specs[i].height;
+        struct stat info;
+        if (stat(filename.c_str(), &info) == 0 && (size_t)info.st_size == bytes) {
+            cout << filename << " already there" << endl;
+            continue;
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if (!write_corpus_image(filename, specs[i])) {
+            cerr << "Could not write " << filename << endl;
+            failures++;
+            continue;
+        }
+        double ms = elapsed_ms(start);
+        cout << filename << ": " << ms << " ms, " << bytes / 1e6 / (ms / 1000) << " MB/s" << endl;
+    }
+    return failures;
+}
+
+//**************************************************************************************************//
+//                                          Metrics                                                 //
+//**************************************************************************************************//
+
+// Counters are split into shards, one per thread where there are enough, so threads recording
+// at the same time do not fight over a cache line
+const int METRIC_SHARDS = 16;
+// Upper bounds of the latency histogram buckets, in seconds
+const double LATENCY_BUCKETS[] = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5};
+const int LATENCY_BUCKET_COUNT = 12;
+
+struct LatencyHistogram
+{
+    // The last bucket counts everything above the largest bound
+    atomic<long long> buckets[LATENCY_BUCKET_COUNT + 1];
+    atomic<long long> sum_us;
+};
+
+struct alignas(CACHE_LINE) MetricShard
+{
+    atomic<long long> images;
+    atomic<long long> failures;
+    atomic<long long> bytes_in;
+    atomic<long long> bytes_out;
+    // Requests that found their chain's filter states already built, and those that did not
+    atomic<long long> chain_hits;
+    atomic<long long> chain_misses;
+    atomic<long long> busy_us;
+    // Read to write time of each image
+    LatencyHistogram image_latency;
+    // Time of each filter, by selection
+    LatencyHistogram filter_latency[10];
+};
+
+// Values that go up and down, set by the mode that is running
+struct MetricGauges
+{
+    atomic<long long> workers;
+    atomic<long long> busy_workers;
+    atomic<long long> queue_depth;
+    atomic<long long> connections;
+};
+
+MetricShard metric_shards[METRIC_SHARDS];
+MetricGauges metric_gauges;
+atomic<int> next_metric_shard(0);
+
+// Latencies are kept in microseconds in log-linear buckets, as HDR histograms do: values below
+// HDR_LINEAR get a bucket each, and each power of two above that is split into HDR_LINEAR / 2
+// buckets, so a percentile is within 1/64 of the true value however large it is
+const int HDR_SHIFT_BITS = 6;
+const long long HDR_LINEAR = 2 << HDR_SHIFT_BITS;
+// Enough buckets for about 12 days
+const int HDR_MAX_SHIFT = 34;
+const int HDR_BUCKETS = HDR_LINEAR + HDR_MAX_SHIFT * (HDR_LINEAR / 2);
+
+// A streaming histogram of latencies, one per thread so recording takes no lock
+struct HdrHistogram
+{
+    vector<long long> counts;
+    long long total;
+    long long max_us;
+};
+
+HdrHistogram new_hdr_histogram() {
+    HdrHistogram histogram;
+    histogram.counts.assign(HDR_BUCKETS, 0);
+    histogram.total = 0;
+    histogram.max_us = 0;
+    return histogram;
+}
+
+int hdr_bucket(long long us) {
+    if (us < HDR_LINEAR) {
+        return max(us, 0LL);
+    }
+    int shift = min(63 - __builtin_clzll(us) - HDR_SHIFT_BITS, HDR_MAX_SHIFT);
+    long long sub = min(us >> shift, HDR_LINEAR - 1);
+    return HDR_LINEAR + (shift - 1) * (HDR_LINEAR / 2) + (sub - HDR_LINEAR / 2);
+}
+
+// The largest value in a bucket
+long long hdr_bucket_top(int bucket) {
+    if (bucket < HDR_LINEAR) {
+        return bucket;
+    }
+    int shift = (bucket - HDR_LINEAR) / (HDR_LINEAR / 2) + 1;
+    long long sub = (bucket - HDR_LINEAR) % (HDR_LINEAR / 2) + HDR_LINEAR / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hdr_record(HdrHistogram& histogram, double ms) {
+    long long us = (long long)(ms * 1000);
+    histogram.counts[hdr_bucket(us)]++;
+    histogram.total++;
+    histogram.max_us = max(histogram.max_us, us);
+}
+
+void hdr_merge(HdrHistogram& into, const HdrHistogram& from) {
+    for (int i = 0; i < HDR_BUCKETS; i++) {
+        into.counts[i] += from.counts[i];
+    }
+    into.total += from.total;
+    into.max_us = max(into.max_us, from.max_us);
+}
+
+/**
+ * Finds the latency a fraction of the recorded values are at or below
+ * @param histogram The histogram
+ * @param fraction Such as 0.99 for the 99th percentile
+ * @return the latency in milliseconds, 0 if nothing was recorded
+ */
+double hdr_percentile(const HdrHistogram& histogram, double fraction) {
+    long long wanted = max(1LL, (long long)ceil(fraction * histogram.total));
+    long long seen = 0;
+    for (int i = 0; i < HDR_BUCKETS && histogram.total > 0; i++) {
+        seen += histogram.counts[i];
+        if (seen >= wanted) {
+            return min(hdr_bucket_top(i), histogram.max_us) / 1000.0;
+        }
+    }
+    return histogram.max_us / 1000.0;
+}
+
+// The calling thread's shard
+MetricShard& metric_shard() {
+    thread_local int shard = next_metric_shard++ % METRIC_SHARDS;
+    return metric_shards[shard];
+}
+
+void count_metric(atomic<long long>& counter, long long amount) {
+    counter.fetch_add(amount, memory_order_relaxed);
+}
+
+void observe_latency(LatencyHistogram& histogram, double ms) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT && ms > LATENCY_BUCKETS[bucket] * 1000) {
+        bucket++;
+    }
+    count_metric(histogram.buckets[bucket], 1);
+    count_metric(histogram.sum_us, (long long)(ms * 1000));
+}
+
+// Sums one counter over every shard
+long long metric_total(atomic<long long> MetricShard::* counter) {
+    long long total = 0;
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        total = total + (metric_shards[i].*counter).load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void write_metric(ostream& out, string name, string type, string help, double value) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+    out << name << " " << value << "\n";
+}
+
+/**
+ * Writes one histogram's series, summing its shards
+ * @param out The stream to write to
+ * @param name The metric name
+ * @param labels The series labels, such as filter="greyscale", or "" for none
+ * @param histograms Returns a shard's histogram
+ * @return nothing
+ */
+template <typename Select>
+void write_histogram(ostream& out, string name, string labels, Select histograms) {
+    long long buckets[LATENCY_BUCKET_COUNT + 1] = {0};
+    long long sum_us = 0;
+    for (int i = 0; i < METRIC_SHARDS; i++) {
+        LatencyHistogram& histogram = histograms(metric_shards[i]);
+        for (int b = 0; b <= LATENCY_BUCKET_COUNT; b++) {
+            buckets[b] = buckets[b] + histogram.buckets[b].load(memory_order_relaxed);
+        }
+        sum_us = sum_us + histogram.sum_us.load(memory_order_relaxed);
+    }
+    string separator = labels.empty() ? "" : ",";
+    long long count = 0;
+    for (int b = 0; b <= LATENCY_BUCKET_COUNT; b++) {
+        count = count + buckets[b];
+        ostringstream bound;
+        if (b < LATENCY_BUCKET_COUNT) {
+            bound << LATENCY_BUCKETS[b];
+        } else {
+            bound << "+Inf";
+        }
+        out << name << "_bucket{" << labels << separator << "le=\"" << bound.str() << "\"} " << count << "\n";
+    }
+    string series = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << series << " " << sum_us / 1e6 << "\n";
+    out << name << "_count" << series << " " << count << "\n";
+}
+
+// Renders every metric in the Prometheus text exposition format
+string render_metrics() {
+    ostringstream out;
+    // Enough digits that byte counts are not rounded
+    out.precision(15);
+    write_metric(out, "horn_images_total", "counter", "Images filtered.",
+                 metric_total(&MetricShard::images));
+    write_metric(out, "horn_failures_total", "counter", "Images or requests that could not be filtered.",
+                 metric_total(&MetricShard::failures));
+    write_metric(out, "horn_bytes_in_total", "counter", "Bytes of encoded images read.",
+                 metric_total(&MetricShard::bytes_in));
+    write_metric(out, "horn_bytes_out_total", "counter", "Bytes of encoded images written.",
+                 metric_total(&MetricShard::bytes_out));
+    write_metric(out, "horn_chain_cache_hits_total", "counter",
+                 "Requests whose filter states were already built.", metric_total(&MetricShard::chain_hits));
+    write_metric(out, "horn_chain_cache_misses_total", "counter",
+                 "Requests that had to build their filter states.", metric_total(&MetricShard::chain_misses));
+    write_metric(out, "horn_tiles_total", "counter", "Tiles run by the tiled executor.", engine_stats.tiles);
+    write_metric(out, "horn_uniform_tiles_total", "counter", "Tiles computed from a single pixel.",
+                 engine_stats.uniform_tiles);
+    write_metric(out, "horn_engine_tile_size", "gauge", "Tile side of point-wise filters, in pixels.", tile_size);
+    write_metric(out, "horn_engine_rotate_block", "gauge", "Block side of quarter turns, in pixels.", rotate_block);
+    write_metric(out, "horn_engine_band_rows", "gauge", "Rows per band of a sweep.", band_rows);
+    write_metric(out, "horn_engine_threads", "gauge", "Worker threads per image.", worker_count());
+    write_metric(out, "horn_worker_busy_seconds_total", "counter", "Time workers spent on images.",
+                 metric_total(&MetricShard::busy_us) / 1e6);
+    write_metric(out, "horn_workers", "gauge", "Worker threads in the pool.", metric_gauges.workers);
+    write_metric(out, "horn_busy_workers", "gauge", "Worker threads working on an image.",
+                 metric_gauges.busy_workers);
+    write_metric(out, "horn_queue_depth", "gauge", "Work waiting for a worker.", metric_gauges.queue_depth);
+    write_metric(out, "horn_open_connections", "gauge", "Open client connections.", metric_gauges.connections);
+
+    out << "# HELP horn_image_duration_seconds Time from reading an image to writing its output.\n";
+    out << "# TYPE horn_image_duration_seconds histogram\n";
+    write_histogram(out, "horn_image_duration_seconds", "",
+                    [](MetricShard& shard) -> LatencyHistogram& { return shard.image_latency; });
+    out << "# HELP horn_filter_duration_seconds Time to run one filter over one image.\n";
+    out << "# TYPE horn_filter_duration_seconds histogram\n";
+    for (int k = 0; k < 10; k++) {
+        write_histogram(out, "horn_filter_duration_seconds", "filter=\"" + spec_names[k] + "\"",
+                        [k](MetricShard& shard) -> LatencyHistogram& { return shard.filter_latency[k]; });
+    }
+    return out.str();
+}
+
+/**
+ * Saves the metrics to a file for a collector to read, replacing it in one step so a reader
+ * never sees half of it
+ * @param filename The file to write
+ * @return True if successful and false otherwise
+ */
+bool write_metrics_file(string filename) {
+    string temp = filename + ".tmp";
+    ofstream out(temp, ios::out | ios::binary | ios::trunc);
+    out << render_metrics();
+    out.close();
+    return !out.fail() && rename(temp.c_str(), filename.c_str()) == 0;
+}
+
+//**************************************************************************************************//
+//                                          Batch                                                   //
+//**************************************************************************************************//
+
+// Work per thread, in greyscale pixels, below which splitting an image across threads costs
+// more in start up and synchronization than it saves
+const double BATCH_GRAIN = PARALLEL_MIN_PIXELS;
+
+// Rough cost of a filter per input pixel, relative to greyscale
+double filter_cost(const FilterSpec& spec) {
+    switch (spec.selection) {
+        case 1:
+        case 2: return 1.5;
+        // Quarter turns read the input a column at a time
+        case 4:
+        case 5: return spec.rotations % 4 == 0 ? 0.5 : 3.0;
+        // Every input pixel becomes x_scale * y_scale output pixels
+        case 6: return (double)spec.x_scale * spec.y_scale;
+        default: return 1.0;
+    }
+}
+
+/**
+ * Estimates the work of running a chain of filters over an image
+ * @param chain The filters, applied in order
+ * @param pixels The number of pixels in the input image
+ * @return the work in greyscale pixels
+ */
+double chain_work(const vector<FilterSpec>& chain, long long pixels) {
+    double work = 0;
+    double size = pixels;
+    for (size_t i = 0; i < chain.size(); i++) {
+        work = work + filter_cost(chain[i]) * size;
+        if (chain[i].selection == 6) {
+            size = size * chain[i].x_scale * chain[i].y_scale;
+        }
+    }
+    return work;
+}
+
+// How a batch is spread over the cores
+struct BatchPlan
+{
+    // Images filtered at the same time, each on its own thread
+    int image_workers;
+    // Threads each of those images is split across
+    int threads_per_image;
+    string mode;
+};
+
+/**
+ * Chooses whether to run a batch across images, within images or both. Each image gets one
+ * thread per BATCH_GRAIN of work, so small images run one per core with no splitting and
+ * large images get every core one at a time.
+ * @param works The estimated work of each image
+ * @param cores The number of threads available
+ * @return the plan
+ */
+BatchPlan plan_batch(vector<double> works, int cores) {
+    sort(works.begin(), works.end());
+    double median = works[works.size() / 2];
+    int threads = (int)min((double)cores, max(1.0, median / BATCH_GRAIN));
+    BatchPlan plan;
+    plan.image_workers = min(max(1, cores / threads), (int)works.size());
+    // A batch with fewer images than cores gives the spare cores to the images it has
+    plan.threads_per_image = max(threads, cores / plan.image_workers);
+    if (plan.image_workers == 1) {
+        plan.mode = "intra-image";
+    } else if (plan.threads_per_image == 1) {
+        plan.mode = "inter-image";
+    } else {
+        plan.mode = "inter- and intra-image";
+    }
+    return plan;
+}
+
+/**
+ * Reads filter settings from command line arguments
+ * @param args The arguments, each NAME[:VALUE]
+ * @param specs Set to the filter settings
+ * @return True if every argument is a valid filter and false otherwise
+ */
+bool parse_filter_specs(const vector<string>& args, vector<FilterSpec>& specs) {
+    for (size_t i = 0; i < args.size(); i++) {
+        FilterSpec spec;
+        if (!parse_filter_spec(args[i], spec)) {
+            cerr << "Unknown filter " << args[i] << endl;
+            return false;
+        }
+        specs.push_back(spec);
+    }
+    return true;
+}
+
+/**
+ * Reads a chain of filters separated by commas, such as greyscale,lighten:0.5
+ * @param text The chain
+ * @param chain Set to the filter settings, in order
+ * @return True if the chain has at least one filter and every one is valid, false otherwise
+ */
+bool parse_filter_chain(string text, vector<FilterSpec>& chain) {
+    vector<string> names;
+    stringstream chain_text(text);
+    string name;
+    while (getline(chain_text, name, ',')) {
+        names.push_back(name);
+    }
+    return parse_filter_specs(names, chain) && !chain.empty();
+}
+
+// Settings for a batch run beyond its files and filters
+struct BatchOptions
+{
+    // The filter chain as given, recorded in the journal
+    string chain_text;
+    // If not empty, finished items are recorded here and skipped when the run is restarted
+    string journal;
+    // If not empty, the directory of lease files several processes share the files through
+    string shard_dir;
+    // If more than 0, files are filtered by this many worker processes instead of threads
+    int prefork;
+    // Files per leased chunk
+    int chunk_size;
+    // Seconds a lease lasts without being renewed
+    int lease_seconds;
+    // Seconds a prefork worker may spend on one file before it is killed and replaced
+    int job_seconds;
+    // Skips the plan and throughput report, for runs over part of a larger batch
+    bool quiet;
+    // If set, workers stop taking new files once it becomes true
+    const atomic<bool>* abandon;
+    // If more than 0, images taking longer than this many milliseconds are listed
+    double budget_ms;
+    // If not empty, the latency percentiles are saved here as JSON
+    string report;
+};
+
+BatchOptions new_batch_options() {
+    BatchOptions options;
+    options.prefork = 0;
+    options.chunk_size = 64;
+    options.lease_seconds = 30;
+    options.job_seconds = 60;
+    options.quiet = false;
+    options.abandon = NULL;
+    options.budget_ms = 0;
+    return options;
+}
+
+// Output files keep the input's name, placed in the output directory
+string batch_output(string out_dir, string file) {
+    size_t slash = file.find_last_of('/');
+    return out_dir + "/" + (slash == string::npos ? file : file.substr(slash + 1));
+}
+
+// A thread's filter states and buffers for filtering whole files, kept between files
+struct ChainWorker
+{
+    vector<FilterState> states;
+    Image image;
+    Image new_image;
+    vector<unsigned char> buffer;
+    // Pixels in the last input image filtered
+    long long pixels;
+    // Set to have run_chain_to_bmp() hash the output it encodes
+    bool hash_output;
+    // The hash_image() of the output in buffer, when hash_output is set
+    uint64_t output_hash;
+    // Milliseconds each stage of the last file took, indexed by STAGE_READ and so on, with the
+    // filters from STAGE_FILTERS on; negative for stages that did not run
+    vector<double> stage_ms;
+};
+
+const int STAGE_READ = 0;
+const int STAGE_DECODE = 1;
+const int STAGE_ENCODE = 2;
+const int STAGE_WRITE = 3;
+const int STAGE_FILTERS = 4;
+const string stage_names[STAGE_FILTERS] = {"read", "decode", "encode", "write"};
+
+ChainWorker new_chain_worker(const vector<FilterSpec>& chain) {
+    ChainWorker worker;
+    for (size_t k = 0; k < chain.size(); k++) {
+        worker.states.push_back(new_state(chain[k]));
+    }
+    worker.pixels = 0;
+    worker.hash_output = false;
+    worker.output_hash = 0;
+    worker.stage_ms.assign(STAGE_FILTERS + chain.size(), -1);
+    return worker;
+}
+
+// Applies the worker's chain of filters to worker.image, leaving the result there; only the
+// first stages filters are run if that is fewer
+void run_chain(ChainWorker& worker, size_t stages = numeric_limits<size_t>::max()) {
+    MetricShard& shard = metric_shard();
+    for (size_t k = 0; k < worker.states.size() && k < stages; k++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        const FilterSpec& spec = worker.states[k].spec;
+        if ((spec.selection == 4 || spec.selection == 5) && spec.rotations % 4 == 2) {
+            // Half turns need no second image
+            rotate_180_in_place(worker.image);
+        } else {
+            run_filter(worker.image, worker.new_image, worker.states[k]);
+            swap(worker.image, worker.new_image);
+        }
+        double ms = elapsed_ms(start);
+        observe_latency(shard.filter_latency[worker.states[k].spec.selection - 1], ms);
+        worker.stage_ms[STAGE_FILTERS + k] = ms;
+    }
+}
+
+// True for the filters run_chain_to_bmp() leaves to the encoder when they end a chain
+bool encodes_rotated(const FilterSpec& spec) {
+    return spec.selection == 4 || spec.selection == 5;
+}
+
+/**
+ * Applies the worker's chain of filters to worker.image and encodes the result as a BMP file
+ * in worker.buffer. A rotation at the end of the chain is left to encode_rotated(), which writes
+ * the rotated pixels straight from the unrotated image.
+ * @param worker The filter states and buffers to use
+ * @return nothing
+ */
+void run_chain_to_bmp(ChainWorker& worker) {
+    size_t stages = worker.states.size();
+    int rotations = 0;
+    if (stages > 0 && encodes_rotated(worker.states[stages - 1].spec)) {
+        stages--;
+        rotations = worker.states[stages].spec.rotations;
+    }
+    run_chain(worker, stages);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    encode_rotated(worker.image, rotations, worker.buffer, worker.hash_output ? &worker.output_hash : NULL);
+    worker.stage_ms[STAGE_ENCODE] = elapsed_ms(start);
+}
+
+// Saves bytes to a temporary file renamed into place
+bool write_file(string filename, const unsigned char* data, size_t size) {
+    string temp = temp_name(filename);
+    ofstream out(temp, ios::out | ios::binary | ios::trunc);
+    out.write((const char*)data, size);
+    out.close();
+    if (out.fail() || rename(temp.c_str(), filename.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reads an image, applies the worker's chain of filters and saves the result, writing it to a
+ * temporary file renamed into place
+ * @param worker The filter states and buffers to use
+ * @param input The BMP file to filter
+ * @param output The file to save the result to
+ * @param error Set to a description of the problem on failure
+ * @return True if the output was saved and false otherwise
+ */
+bool filter_file(ChainWorker& worker, string input, string output, string& error) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    MetricShard& shard = metric_shard();
+    metric_gauges.busy_workers++;
+    fill(worker.stage_ms.begin(), worker.stage_ms.end(), -1);
+    bool ok = read_file(input, worker.buffer);
+    worker.stage_ms[STAGE_READ] = elapsed_ms(start);
+    if (ok) {
+        chrono::steady_clock::time_point decode_start = chrono::steady_clock::now();
+        ok = decode_image(worker.buffer.data(), worker.buffer.size(), worker.image);
+        worker.stage_ms[STAGE_DECODE] = elapsed_ms(decode_start);
+    }
+    if (!ok) {
+        error = input + ": not a valid BMP image";
+    } else {
+        count_metric(shard.bytes_in, worker.buffer.size());
+        worker.pixels = (long long)worker.image.size() * worker.image[0].size();
+        run_chain_to_bmp(worker);
+        // Outputs appear under their name complete or not at all
+        chrono::steady_clock::time_point write_start = chrono::steady_clock::now();
+        ok = write_file(output, worker.buffer.data(), worker.buffer.size());
+        worker.stage_ms[STAGE_WRITE] = elapsed_ms(write_start);
+        if (!ok) {
+            error = "Could not write " + output;
+        } else {
+            count_metric(shard.bytes_out, worker.buffer.size());
+        }
+    }
+    double ms = elapsed_ms(start);
+    count_metric(ok ? shard.images : shard.failures, 1);
+    if (ok) {
+        observe_latency(shard.image_latency, ms);
+    }
+    count_metric(shard.busy_us, (long long)(ms * 1000));
+    metric_gauges.busy_workers--;
+    return ok;
+}
+
+// An item recorded in a batch journal as finished
+struct JournalEntry
+{
+    long long size;
+    uint64_t hash;
+};
+
+// Append-only record of the items a batch run has finished, so a restarted run can skip them
+struct BatchJournal
+{
+    ofstream out;
+    mutex lock;
+    // Input file -> its finished output
+    map<string, JournalEntry> done;
+};
+
+/**
+ * Opens a batch journal, loading the items it records. Each line is the output's size, its
+ * pixel hash and the input file, separated by tabs; a line cut short by a crash is ignored.
+ * A journal written for a different filter chain is started again.
+ * @param journal The journal to open
+ * @param filename The journal file, created if needed
+ * @param chain_text The filter chain of this run, recorded in the journal's first line
+ * @return True if the journal could be opened and false otherwise
+ */
+bool open_journal(BatchJournal& journal, string filename, string chain_text) {
+    string header = "# batch journal\t" + chain_text;
+    ifstream in(filename);
+    string line;
+    bool resume = getline(in, line) && line == header && !in.eof();
+    bool torn = false;
+    while (resume && getline(in, line)) {
+        // The last line has no newline if the run stopped while writing it
+        if (in.eof()) {
+            torn = true;
+            break;
+        }
+        stringstream fields(line);
+        string size, hash, input;
+        if (getline(fields, size, '\t') && getline(fields, hash, '\t') && getline(fields, input)
+            && hash.size() == 16) {
+            JournalEntry entry = {atoll(size.c_str()), strtoull(hash.c_str(), NULL, 16)};
+            journal.done[input] = entry;
+        }
+    }
+    in.close();
+    if (resume) {
+        journal.out.open(filename, ios::out | ios::app);
+        // End a torn line so the next item starts on a line of its own
+        if (torn) {
+            journal.out << "\n";
+        }
+    } else {
+        journal.done.clear();
+        journal.out.open(filename, ios::out | ios::trunc);
+        journal.out << header << "\n";
+    }
+    journal.out.flush();
+    return journal.out.good();
+}
+
+void journal_item(BatchJournal& journal, string input, long long size, uint64_t hash) {
+    lock_guard<mutex> guard(journal.lock);
+    journal.out << size << "\t" << hash_to_string(hash) << "\t" << input << "\n";
+    journal.out.flush();
+}
+
+// Checks an output's size against its journal entry, without reading it
+bool journal_size_matches(const BatchJournal& journal, string input, string output) {
+    map<string, JournalEntry>::const_iterator entry = journal.done.find(input);
+    struct stat info;
+    return entry != journal.done.end() && stat(output.c_str(), &info) == 0
+        && info.st_size == entry->second.size;
+}
+
+// Checks an output's pixel hash against its journal entry, reading it into the worker
+bool journal_hash_matches(const BatchJournal& journal, string input, string output, ChainWorker& worker) {
+    uint64_t hash;
+    return read_image(output, worker.image, worker.buffer, &hash)
+        && hash == journal.done.find(input)->second.hash;
+}
+
+// Latency histograms of a batch run: index 0 is whole images, then one per ChainWorker stage
+struct BatchLatency
+{
+    vector<HdrHistogram> stages;
+    // Images over the latency budget and their milliseconds
+    vector<pair<string, double>> over_budget;
+};
+
+BatchLatency new_batch_latency(size_t chain_size) {
+    BatchLatency latency;
+    latency.stages.assign(1 + STAGE_FILTERS + chain_size, new_hdr_histogram());
+    return latency;
+}
+
+// The histograms in the order an image goes through them, with their names. A rotation ending
+// the chain is done by the encoder, so it has no row of its own and is named in the encode row.
+vector<pair<string, int>> latency_rows(const vector<FilterSpec>& chain) {
+    vector<pair<string, int>> rows;
+    rows.push_back(make_pair(string("image"), 0));
+    rows.push_back(make_pair(stage_names[STAGE_READ], 1 + STAGE_READ));
+    rows.push_back(make_pair(stage_names[STAGE_DECODE], 1 + STAGE_DECODE));
+    size_t filters = chain.size();
+    string encode = stage_names[STAGE_ENCODE];
+    if (filters > 0 && encodes_rotated(chain[filters - 1])) {
+        filters--;
+        encode = encode + "+" + spec_label(chain[filters]);
+    }
+    for (size_t k = 0; k < filters; k++) {
+        rows.push_back(make_pair(spec_label(chain[k]), 1 + STAGE_FILTERS + (int)k));
+    }
+    rows.push_back(make_pair(encode, 1 + STAGE_ENCODE));
+    rows.push_back(make_pair(stage_names[STAGE_WRITE], 1 + STAGE_WRITE));
+    return rows;
+}
+
+void print_latency(const BatchLatency& latency, const vector<FilterSpec>& chain, double budget_ms) {
+    vector<pair<string, int>> rows = latency_rows(chain);
+    cout << "Latency (ms)         count       p50       p95       p99       max" << endl;
+    for (size_t i = 0; i < rows.size(); i++) {
+        const HdrHistogram& histogram = latency.stages[rows[i].second];
+        string name = rows[i].first;
+        name.resize(16, ' ');
+        cout << name << setw(9) << histogram.total;
+        const double fractions[] = {0.5, 0.95, 0.99, 1.0};
+        for (int f = 0; f < 4; f++) {
+            cout << setw(10) << hdr_percentile(histogram, fractions[f]);
+        }
+        cout << endl;
+    }
+    if (budget_ms > 0) {
+        cout << latency.over_budget.size() << " images over the " << budget_ms << " ms budget" << endl;
+        for (size_t i = 0; i < latency.over_budget.size(); i++) {
+            cout << "  " << latency.over_budget[i].first << ": " << latency.over_budget[i].second << " ms" << endl;
+        }
+    }
+}
+
+// Quotes a string for JSON
+string json_string(const string& text) {
+    string quoted = "\"";
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Saves the latency percentiles of a batch run as JSON
+ * @param filename The report, written to a temporary file renamed into place
+ * @param latency The run's histograms
+ * @param options The run's options, for the chain and the budget
+ * @param chain The filters
+ * @param images The number of images written
+ * @param seconds The run's wall clock time
+ * @return True if the report was saved and false otherwise
+ */
+bool write_latency_report(string filename, const BatchLatency& latency, const BatchOptions& options,
+                          const vector<FilterSpec>& chain, int images, double seconds) {
+    ostringstream out;
+    out.precision(15);
+    out << "{\n  \"chain\": " << json_string(options.chain_text) << ",\n  \"images\": " << images
+        << ",\n  \"seconds\": " << seconds << ",\n  \"latency_ms\": [";
+    vector<pair<string, int>> rows = latency_rows(chain);
+    for (size_t i = 0; i < rows.size(); i++) {
+        const HdrHistogram& histogram = latency.stages[rows[i].second];
+        out << (i > 0 ? "," : "") << "\n    {\"stage\": " << json_string(rows[i].first)
+            << ", \"count\": " << histogram.total << ", \"p50\": " << hdr_percentile(histogram, 0.5)
+            << ", \"p95\": " << hdr_percentile(histogram, 0.95) << ", \"p99\": " << hdr_percentile(histogram, 0.99)
+            << ", \"max\": " << hdr_percentile(histogram, 1.0) << "}";
+    }
+    out << "\n  ],\n  \"budget_ms\": " << options.budget_ms << ",\n  \"over_budget\": [";
+    for (size_t i = 0; i < latency.over_budget.size(); i++) {
+        out << (i > 0 ? "," : "") << "\n    {\"file\": " << json_string(latency.over_budget[i].first)
+            << ", \"ms\": " << latency.over_budget[i].second << "}";
+    }
+    out << (latency.over_budget.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    string text = out.str();
+    return write_file(filename, (const unsigned char*)text.data(), text.size());
+}
+
+/**
+ * Applies a chain of filters to every file, choosing how to use the cores with plan_batch()
+ * @param files The BMP files to filter
+ * @param out_dir The directory to save the outputs in, created if needed
+ * @param chain The filters to apply to each image, in order
+ * @param options The batch options
+ * @return the number of images that could not be filtered
+ */
+int run_batch(const vector<string>& files, string out_dir, const vector<FilterSpec>& chain,
+              const BatchOptions& options) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    BatchJournal journal;
+    bool journaling = !options.journal.empty();
+    if (journaling && !open_journal(journal, options.journal, options.chain_text)) {
+        cerr << "Could not open " << options.journal << endl;
+        return (int)files.size();
+    }
+    // Items the journal lists whose outputs have the right size; their hashes are checked by
+    // the workers
+    vector<bool> maybe_done(files.size(), false);
+    int maybe_done_count = 0;
+    vector<double> works;
+    long long probed_pixels = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        BmpHeader header;
+        if (journaling && journal_size_matches(journal, files[i], batch_output(out_dir, files[i]))) {
+            maybe_done[i] = true;
+            maybe_done_count++;
+        } else if (probe_image(files[i], header)) {
+            long long pixels = (long long)header.width * header.height;
+            works.push_back(chain_work(chain, pixels));
+            probed_pixels = probed_pixels + pixels;
+        }
+    }
+    if (works.empty() && maybe_done_count == 0) {
+        cerr << "No valid BMP images" << endl;
+        return (int)files.size();
+    }
+    mkdir(out_dir.c_str(), 0755);
+    if (journaling) {
+        cout << "Journal: " << journal.done.size() << " items recorded, " << maybe_done_count
+             << " to verify" << endl;
+    }
+
+    int cores = worker_count();
+    BatchPlan plan = plan_batch(works.empty() ? vector<double>(1, 0.0) : works, cores);
+    double chain_cost = 0;
+    for (size_t i = 0; i < chain.size(); i++) {
+        chain_cost = chain_cost + filter_cost(chain[i]);
+    }
+    if (!options.quiet) {
+        cout << "Batch: " << files.size() << " images, average "
+             << probed_pixels / max((size_t)1, works.size()) / 1e6 << " MP, chain cost " << chain_cost
+             << " per pixel, " << cores << " threads" << endl;
+        cout << "Plan: " << plan.mode << ", " << plan.image_workers << " images at a time with "
+             << plan.threads_per_image << " threads each" << endl;
+    }
+
+    reset_engine_stats();
+    atomic<int> next_file(0);
+    atomic<int> written(0);
+    atomic<int> skipped(0);
+    atomic<long long> pixels(0);
+    mutex log_lock;
+    BatchLatency latency = new_batch_latency(chain.size());
+    auto worker = [&] {
+        image_threads = plan.threads_per_image;
+        ChainWorker chain_worker = new_chain_worker(chain);
+        chain_worker.hash_output = journaling;
+        // Recorded here and merged at the end, so workers never wait on each other to record
+        BatchLatency local = new_batch_latency(chain.size());
+        for (int i = next_file++; i < (int)files.size(); i = next_file++) {
+            if (options.abandon != NULL && *options.abandon) {
+                break;
+            }
+            string output = batch_output(out_dir, files[i]);
+            if (maybe_done[i] && journal_hash_matches(journal, files[i], output, chain_worker)) {
+                skipped++;
+                continue;
+            }
+            string error;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            if (!filter_file(chain_worker, files[i], output, error)) {
+                lock_guard<mutex> lock(log_lock);
+                cerr << error << endl;
+                continue;
+            }
+            double ms = elapsed_ms(start);
+            hdr_record(local.stages[0], ms);
+            for (size_t k = 0; k < chain_worker.stage_ms.size(); k++) {
+                if (chain_worker.stage_ms[k] >= 0) {
+                    hdr_record(local.stages[1 + k], chain_worker.stage_ms[k]);
+                }
+            }
+            if (options.budget_ms > 0 && ms > options.budget_ms) {
+                local.over_budget.push_back(make_pair(files[i], ms));
+            }
+            if (journaling) {
+                journal_item(journal, files[i], chain_worker.buffer.size(), chain_worker.output_hash);
+            }
+            written++;
+            pixels += chain_worker.pixels;
+        }
+        image_threads = 0;
+        lock_guard<mutex> lock(log_lock);
+        for (size_t k = 0; k < local.stages.size(); k++) {
+            hdr_merge(latency.stages[k], local.stages[k]);
+        }
+        latency.over_budget.insert(latency.over_budget.end(), local.over_budget.begin(), local.over_budget.end());
+    };
+    vector<thread> threads;
+    for (int i = 1; i < plan.image_workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    double seconds = elapsed_ms(start) / 1000.0;
+    if (!options.quiet) {
+        cout << "Batch: " << written << " of " << files.size() << " images written in " << seconds
+             << " s, " << written / seconds << " images/sec, " << pixels / seconds / 1e6 << " MP/s" << endl;
+        if (journaling) {
+            cout << "Skipped " << skipped << " images finished by an earlier run" << endl;
+        }
+        print_engine_stats();
+        sort(latency.over_budget.begin(), latency.over_budget.end());
+        print_latency(latency, chain, options.budget_ms);
+    }
+    if (!options.report.empty() && !write_latency_report(options.report, latency, options, chain, written, seconds)) {
+        cerr << "Could not write " << options.report << endl;
+    }
+    return (int)files.size() - written - skipped;
+}
+
+//**************************************************************************************************//
+//                                         Sharding                                                 //
+//**************************************************************************************************//
+
+// Several processes, on one host or several sharing a filesystem, split a batch by leasing
+// chunks of its sorted file list. The lease on chunk N is the file chunk-N.lease.G with the
+// highest generation G: it is claimed by creating it with O_EXCL, renewed by touching it, and
+// an expired one is reclaimed by creating generation G + 1, so O_EXCL settles every race. A
+// holder that finds a newer generation has lost its lease and stops. chunk-N.done marks a
+// finished chunk.
+
+struct Lease
+{
+    int chunk;
+    int generation;
+    int fd;
+    string path;
+};
+
+string chunk_file(string shard_dir, int chunk, string suffix) {
+    string number = to_string(chunk);
+    return shard_dir + "/chunk-" + string(number.size() < 6 ? 6 - number.size() : 0, '0') + number + suffix;
+}
+
+string lease_file(string shard_dir, int chunk, int generation) {
+    return chunk_file(shard_dir, chunk, ".lease." + to_string(generation));
+}
+
+bool file_exists(string path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
+
+/**
+ * Tries to lease a chunk
+ * @param shard_dir The lease directory
+ * @param chunk The chunk to lease
+ * @param lease_seconds Seconds after its last renewal that a lease expires
+ * @param lease Set to the lease on success
+ * @param reclaimed Set to true if the chunk's previous lease had expired
+ * @param error Set to a description of the problem if the lease directory could not be used,
+ *              and left empty if the chunk is just finished or leased elsewhere
+ * @return True if the chunk is now leased to this process, false if it is finished or leased,
+ *         or on an error
+ */
+bool claim_chunk(string shard_dir, int chunk, int lease_seconds, Lease& lease, bool& reclaimed, string& error) {
+    string done = chunk_file(shard_dir, chunk, ".done");
+    reclaimed = false;
+    error.clear();
+    if (file_exists(done)) {
+        return false;
+    }
+    for (int generation = 0; ; generation++) {
+        string path = lease_file(shard_dir, chunk, generation);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            // The last holder may have finished since the check above
+            if (file_exists(done)) {
+                close(fd);
+                unlink(path.c_str());
+                return false;
+            }
+            char host[256] = "";
+            gethostname(host, sizeof(host) - 1);
+            string owner = string(host) + " " + to_string(getpid()) + "\n";
+            if (write(fd, owner.data(), owner.size()) < 0) {
+                // The owner is only there to help people reading the directory
+            }
+            lease.chunk = chunk;
+            lease.generation = generation;
+            lease.fd = fd;
+            lease.path = path;
+            return true;
+        }
+        if (errno != EEXIST) {
+            error = "Could not create " + path + ": " + strerror(errno);
+            return false;
+        }
+        if (file_exists(lease_file(shard_dir, chunk, generation + 1))) {
+            continue;
+        }
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            // Removed by a holder finishing the chunk
+            return false;
+        }
+        if (time(NULL) - info.st_mtime < lease_seconds) {
+            return false;
+        }
+        reclaimed = true;
+    }
+}
+
+// Renews a lease, returning false if another process has reclaimed it
+bool renew_lease(string shard_dir, const Lease& lease) {
+    if (file_exists(lease_file(shard_dir, lease.chunk, lease.generation + 1))) {
+        return false;
+    }
+    return futimens(lease.fd, NULL) == 0;
+}
+
+// Marks a leased chunk finished and removes its lease files
+void finish_chunk(string shard_dir, const Lease& lease) {
+    int fd = open(chunk_file(shard_dir, lease.chunk, ".done").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        close(fd);
+    }
+    close(lease.fd);
+    for (int generation = 0; generation <= lease.generation; generation++) {
+        unlink(lease_file(shard_dir, lease.chunk, generation).c_str());
+    }
+}
+
+/**
+ * Runs this process's share of a batch: leases chunks of the sorted file list one at a time
+ * and filters them with run_batch(), until every chunk is finished by some process. Chunks
+ * leased by a process that has stopped renewing are reclaimed once the lease expires.
+ * @param files The BMP files of the whole batch, the same list in every process
+ * @param out_dir The directory to save the outputs in
+ * @param chain The filters to apply to each image, in order
+ * @param options The batch options, with shard_dir, chunk_size and lease_seconds set
+ * @return the number of images in this process's chunks that could not be filtered
+ */
+int run_sharded(vector<string> files, string out_dir, const vector<FilterSpec>& chain,
+                BatchOptions options) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    sort(files.begin(), files.end());
+    int chunks = (files.size() + options.chunk_size - 1) / options.chunk_size;
+    const string dirs[] = {options.shard_dir, out_dir};
+    for (int i = 0; i < 2; i++) {
+        if (mkdir(dirs[i].c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Could not create " << dirs[i] << ": " << strerror(errno) << endl;
+            return (int)files.size();
+        }
+    }
+    cout << "Shard: " << files.size() << " images in " << chunks << " chunks of " << options.chunk_size
+         << ", process " << getpid() << endl;
+
+    atomic<bool> lost(false);
+    options.quiet = true;
+    options.abandon = &lost;
+    int failed = 0, chunks_done = 0, chunks_reclaimed = 0, chunks_lost = 0;
+    long long images = 0;
+    bool finished = false;
+    while (!finished) {
+        finished = true;
+        bool claimed = false;
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            Lease lease;
+            bool reclaimed;
+            string error;
+            if (!claim_chunk(options.shard_dir, chunk, options.lease_seconds, lease, reclaimed, error)) {
+                if (!error.empty()) {
+                    // No process can lease the chunks, so waiting for them would never end;
+                    // every file of a chunk not yet finished counts as failed
+                    cerr << error << endl;
+                    for (int rest = 0; rest < chunks; rest++) {
+                        if (!file_exists(chunk_file(options.shard_dir, rest, ".done"))) {
+                            failed = failed + min(files.size() - (size_t)rest * options.chunk_size,
+                                                  (size_t)options.chunk_size);
+                        }
+                    }
+                    return failed;
+                }
+                finished = finished && file_exists(chunk_file(options.shard_dir, chunk, ".done"));
+                continue;
+            }
+            claimed = true;
+            chunks_reclaimed += reclaimed;
+            lost = false;
+
+            // Renew the lease in the background while the chunk is filtered
+            mutex renew_lock;
+            condition_variable renew_wake;
+            bool chunk_finished = false;
+            thread renewer([&] {
+                unique_lock<mutex> guard(renew_lock);
+                while (!chunk_finished) {
+                    renew_wake.wait_for(guard, chrono::milliseconds(options.lease_seconds * 1000 / 3));
+                    if (!chunk_finished && !renew_lease(options.shard_dir, lease)) {
+                        lost = true;
+                    }
+                }
+            });
+            size_t first = (size_t)chunk * options.chunk_size;
+            vector<string> chunk_files(files.begin() + first,
+                                       files.begin() + min(files.size(), first + options.chunk_size));
+            int chunk_failed = run_batch(chunk_files, out_dir, chain, options);
+            {
+                lock_guard<mutex> guard(renew_lock);
+                chunk_finished = true;
+                renew_wake.notify_all();
+            }
+            renewer.join();
+
+            if (lost || !renew_lease(options.shard_dir, lease)) {
+                // The process that reclaimed the chunk finishes it
+                cout << "Lost the lease on chunk " << chunk << endl;
+                close(lease.fd);
+                chunks_lost++;
+                continue;
+            }
+            finish_chunk(options.shard_dir, lease);
+            failed = failed + chunk_failed;
+            images = images + chunk_files.size() - chunk_failed;
+            chunks_done++;
+        }
+        // Wait for chunks leased by other processes, in case their leases expire
+        if (!finished && !claimed) {
+            this_thread::sleep_for(chrono::seconds(1));
+        }
+    }
+
+    double seconds = elapsed_ms(start) / 1000.0;
+    cout << "Shard: " << chunks_done << " chunks, " << images << " images written in " << seconds
+         << " s, " << images / seconds << " images/sec; " << chunks_reclaimed << " chunks reclaimed, "
+         << chunks_lost << " leases lost" << endl;
+    return failed;
+}
+
+//**************************************************************************************************//
+//                                       Prefork Pool                                               //
+//**************************************************************************************************//
+
+// A job for a worker process: its shared memory holds input_size bytes of a BMP file
+struct PreforkJob
+{
+    uint32_t index;
+    uint64_t input_size;
+    // Size of the shared memory, so the worker can map all of it
+    uint64_t capacity;
+};
+
+// A worker's answer: its shared memory holds output_size bytes of the filtered BMP file
+struct PreforkResult
+{
+    uint32_t index;
+    // 0 if the image was filtered, 1 if it was not a valid BMP image
+    int32_t status;
+    uint64_t output_size;
+    // Size of the shared memory, which the worker grows when an output does not fit
+    uint64_t capacity;
+    int64_t pixels;
+};
+
+// The supervisor's side of one worker process
+struct PreforkWorker
+{
+    pid_t pid;
+    // Jobs go out on one pipe and results come back on another; pixels go through shm_fd
+    int job_fd;
+    int result_fd;
+    int shm_fd;
+    unsigned char* map;
+    size_t mapped;
+    // The file being filtered, or -1 when idle
+    int file;
+    // When the file was handed over, to kill a worker stuck on it
+    chrono::steady_clock::time_point started;
+};
+
+bool read_full(int fd, void* data, size_t size) {
+    char* next = (char*)data;
+    while (size > 0) {
+        ssize_t got = read(fd, next, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        next = next + got;
+        size = size - got;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void* data, size_t size) {
+    const char* next = (const char*)data;
+    while (size > 0) {
+        ssize_t put = write(fd, next, size);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        next = next + put;
+        size = size - put;
+    }
+    return true;
+}
+
+// Maps the first size bytes of a shared memory file, replacing an older mapping
+bool map_shared(int shm_fd, size_t size, unsigned char*& map, size_t& mapped) {
+    if (map != NULL) {
+        munmap(map, mapped);
+    }
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    map = address == MAP_FAILED ? NULL : (unsigned char*)address;
+    mapped = map == NULL ? 0 : size;
+    return map != NULL;
+}
+
+// Grows a shared memory file to hold at least size bytes, by doubling
+size_t grow_shared(int shm_fd, size_t capacity, size_t size) {
+    while (capacity < size) {
+        capacity = capacity * 2;
+    }
+    return ftruncate(shm_fd, capacity) == 0 ? capacity : 0;
+}
+
+// The worker process: decodes, filters and encodes each job in shared memory until its job pipe closes
+void prefork_child(int job_fd, int result_fd, int shm_fd, const vector<FilterSpec>& chain) {
+    // Each process filters one image at a time; the pool spreads images across the cores
+    image_threads = 1;
+    ChainWorker worker = new_chain_worker(chain);
+    unsigned char* map = NULL;
+    size_t mapped = 0;
+    PreforkJob job;
+    while (read_full(job_fd, &job, sizeof(job))) {
+        if (job.capacity != mapped && !map_shared(shm_fd, job.capacity, map, mapped)) {
+            break;
+        }
+        PreforkResult result = {job.index, 1, 0, job.capacity, 0};
+        if (decode_image(map, job.input_size, worker.image)) {
+            result.pixels = (int64_t)worker.image.size() * worker.image[0].size();
+            run_chain_to_bmp(worker);
+            if (worker.buffer.size() > mapped) {
+                result.capacity = grow_shared(shm_fd, mapped, worker.buffer.size());
+                if (result.capacity == 0 || !map_shared(shm_fd, result.capacity, map, mapped)) {
+                    break;
+                }
+            }
+            memcpy(map, worker.buffer.data(), worker.buffer.size());
+            result.output_size = worker.buffer.size();
+            result.status = 0;
+        }
+        if (!write_full(result_fd, &result, sizeof(result))) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+/**
+ * Starts a worker process with its own pipes and shared memory
+ * @param workers Every worker, so the new process can close the others' pipes; otherwise a
+ * crashed worker's result pipe would stay open in its siblings and never report the crash
+ * @param slot The worker to start
+ * @param chain The filters to apply to each image, in order
+ * @return True if the process started and false otherwise
+ */
+bool start_prefork_worker(vector<PreforkWorker>& workers, int slot, const vector<FilterSpec>& chain) {
+    PreforkWorker& worker = workers[slot];
+    int jobs[2], results[2];
+    worker.shm_fd = memfd_create("horn-prefork", MFD_CLOEXEC);
+    worker.map = NULL;
+    worker.mapped = 0;
+    worker.file = -1;
+    if (worker.shm_fd < 0 || ftruncate(worker.shm_fd, 1 << 20) != 0
+        || !map_shared(worker.shm_fd, 1 << 20, worker.map, worker.mapped)) {
+        return false;
+    }
+    if (pipe2(jobs, O_CLOEXEC) != 0) {
+        return false;
+    }
+    if (pipe2(results, O_CLOEXEC) != 0) {
+        close(jobs[0]);
+        close(jobs[1]);
+        return false;
+    }
+    // Output still buffered would be written by the child as well
+    cout.flush();
+    cerr.flush();
+    worker.pid = fork();
+    if (worker.pid == 0) {
+        for (size_t i = 0; i < workers.size(); i++) {
+            if ((int)i != slot && workers[i].pid > 0) {
+                close(workers[i].job_fd);
+                close(workers[i].result_fd);
+            }
+        }
+        close(jobs[1]);
+        close(results[0]);
+        prefork_child(jobs[0], results[1], worker.shm_fd, chain);
+    }
+    close(jobs[0]);
+    close(results[1]);
+    worker.job_fd = jobs[1];
+    worker.result_fd = results[0];
+    return worker.pid > 0;
+}
+
+// Closes a worker's pipes, waits for it to exit and releases its shared memory
+int stop_prefork_worker(PreforkWorker& worker) {
+    close(worker.job_fd);
+    close(worker.result_fd);
+    int status = 0;
+    waitpid(worker.pid, &status, 0);
+    munmap(worker.map, worker.mapped);
+    close(worker.shm_fd);
+    worker.pid = 0;
+    return status;
+}
+
+// Reads a whole file into a worker's shared memory, growing it if needed
+bool read_into_shared(string filename, PreforkWorker& worker, size_t& size) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size = info.st_size;
+    if (size > worker.mapped) {
+        size_t capacity = grow_shared(worker.shm_fd, worker.mapped, size);
+        if (capacity == 0 || !map_shared(worker.shm_fd, capacity, worker.map, worker.mapped)) {
+            close(fd);
+            return false;
+        }
+    }
+    bool ok = read_full(fd, worker.map, size);
+    close(fd);
+    return ok;
+}
+
+/**
+ * Filters every file in a pool of worker processes, so a file that crashes the decoder or a
+ * filter only costs that file. The supervisor reads each input into a worker's shared memory
+ * and writes the output the worker leaves there, sending only job and result records over the
+ * pipes. A worker that dies, or hangs on a file for longer than job_seconds, is reported and
+ * replaced, and its file counted as failed.
+ * @param files The BMP files to filter
+ * @param out_dir The directory to save the outputs in, created if needed
+ * @param chain The filters to apply to each image, in order
+ * @param processes The number of worker processes
+ * @param job_seconds Seconds a worker may spend on one file
+ * @return the number of images that could not be filtered
+ */
+int run_prefork(const vector<string>& files, string out_dir, const vector<FilterSpec>& chain, int processes,
+                int job_seconds) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    mkdir(out_dir.c_str(), 0755);
+    // A job sent to a worker that has just died must not kill the supervisor
+    signal(SIGPIPE, SIG_IGN);
+    vector<PreforkWorker> workers(processes);
+    for (int i = 0; i < processes; i++) {
+        workers[i].pid = 0;
+    }
+    for (int i = 0; i < processes; i++) {
+        if (!start_prefork_worker(workers, i, chain)) {
+            cerr << "Could not start worker process: " << strerror(errno) << endl;
+            return (int)files.size();
+        }
+    }
+    cout << "Prefork: " << files.size() << " images, " << processes << " worker processes" << endl;
+
+    size_t next_file = 0;
+    int busy = 0, written = 0, failed = 0, crashes = 0;
+    long long pixels = 0;
+    vector<pollfd> waiting(processes);
+    while (next_file < files.size() || busy > 0) {
+        // Hand a file to every idle worker, reading it straight into the worker's shared memory
+        for (int i = 0; i < processes && next_file < files.size(); i++) {
+            PreforkWorker& worker = workers[i];
+            if (worker.file >= 0) {
+                continue;
+            }
+            int file = next_file++;
+            size_t size;
+            if (!read_into_shared(files[file], worker, size)) {
+                cerr << files[file] << ": could not be read" << endl;
+                failed++;
+                i--;
+                continue;
+            }
+            // A worker that has died is reported when its result pipe closes
+            PreforkJob job = {(uint32_t)file, size, worker.mapped};
+            write_full(worker.job_fd, &job, sizeof(job));
+            worker.file = file;
+            worker.started = chrono::steady_clock::now();
+            busy++;
+        }
+
+        // Wake up in time for the first job to run out of time
+        long long timeout_ms = -1;
+        for (int i = 0; i < processes; i++) {
+            waiting[i].fd = workers[i].file >= 0 ? workers[i].result_fd : -1;
+            waiting[i].events = POLLIN;
+            waiting[i].revents = 0;
+            if (workers[i].file >= 0) {
+                long long left = job_seconds * 1000LL - (long long)elapsed_ms(workers[i].started);
+                timeout_ms = max(0LL, timeout_ms < 0 ? left : min(timeout_ms, left));
+            }
+        }
+        if (poll(waiting.data(), processes, (int)timeout_ms) < 0) {
+            continue;
+        }
+        for (int i = 0; i < processes; i++) {
+            PreforkWorker& worker = workers[i];
+            if (worker.file < 0) {
+                continue;
+            }
+            bool hung = waiting[i].revents == 0 && elapsed_ms(worker.started) >= job_seconds * 1000.0;
+            if (waiting[i].revents == 0 && !hung) {
+                continue;
+            }
+            int file = worker.file;
+            worker.file = -1;
+            busy--;
+            PreforkResult result;
+            if (hung || !read_full(worker.result_fd, &result, sizeof(result))) {
+                pid_t pid = worker.pid;
+                if (hung) {
+                    kill(pid, SIGKILL);
+                }
+                int status = stop_prefork_worker(worker);
+                cerr << files[file] << ": worker process " << pid;
+                if (hung) {
+                    cerr << " took over " << job_seconds << " s and was killed";
+                } else {
+                    cerr << " died";
+                    if (WIFSIGNALED(status)) {
+                        cerr << " from signal " << WTERMSIG(status);
+                    }
+                }
+                cerr << ", restarting it" << endl;
+                crashes++;
+                failed++;
+                if (!start_prefork_worker(workers, i, chain)) {
+                    cerr << "Could not restart worker process: " << strerror(errno) << endl;
+                    return failed + (int)(files.size() - next_file);
+                }
+                continue;
+            }
+            if (result.capacity != worker.mapped && !map_shared(worker.shm_fd, result.capacity, worker.map, worker.mapped)) {
+                cerr << "Could not map shared memory" << endl;
+                return failed + (int)(files.size() - next_file);
+            }
+            string output = batch_output(out_dir, files[file]);
+            if (result.status != 0) {
+                cerr << files[file] << ": not a valid BMP image" << endl;
+                failed++;
+            } else if (!write_file(output, worker.map, result.output_size)) {
+                cerr << "Could not write " << output << endl;
+                failed++;
+            } else {
+                written++;
+                pixels = pixels + result.pixels;
+            }
+        }
+    }
+    for (int i = 0; i < processes; i++) {
+        stop_prefork_worker(workers[i]);
+    }
+
+    double seconds = elapsed_ms(start) / 1000.0;
+    cout << "Prefork: " << written << " of " << files.size() << " images written in " << seconds
+         << " s, " << written / seconds << " images/sec, " << pixels / seconds / 1e6 << " MP/s; "
+         << crashes << " worker processes restarted" << endl;
+    return failed;
+}
+
+//**************************************************************************************************//
+//                                        Watch Folder                                              //
+//**************************************************************************************************//
+
+// Set by SIGINT and SIGTERM to ask the long running modes to finish
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+    stop_requested = 1;
+}
+
+// A file that has finished arriving in a watched directory
+struct Arrival
+{
+    string path;
+    chrono::steady_clock::time_point time;
+};
+
+bool is_bmp_name(const string& name) {
+    if (name.empty() || name[0] == '.' || name.size() < 4) {
+        return false;
+    }
+    string suffix = name.substr(name.size() - 4);
+    return suffix == ".bmp" || suffix == ".BMP";
+}
+
+/**
+ * Watches directories for BMP files and applies a chain of filters to each one once it has been
+ * completely written or moved in. A pool of workers, each keeping its filter states and buffers
+ * between files, takes arrivals from a bounded queue; when every worker is busy and the queue
+ * is full, new events wait in the kernel. Runs until SIGINT or SIGTERM.
+ * @param dirs The directories to watch
+ * @param out_dir The directory to save the outputs in, created if needed
+ * @param chain The filters to apply to each image, in order
+ * @param metrics_file If not empty, the metrics are saved to this file about once a second
+ * @return the process exit code
+ */
+int run_watch(const vector<string>& dirs, string out_dir, const vector<FilterSpec>& chain,
+              string metrics_file) {
+    // Outputs renamed into a watched directory would arrive again and be filtered forever. The
+    // directories are compared by device and inode, so out, out/ and ./out are all the same.
+    mkdir(out_dir.c_str(), 0755);
+    struct stat out_info;
+    if (stat(out_dir.c_str(), &out_info) != 0 || !S_ISDIR(out_info.st_mode)) {
+        cerr << "Could not use " << out_dir << " as the output directory" << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < dirs.size(); i++) {
+        struct stat info;
+        if (stat(dirs[i].c_str(), &info) == 0 && info.st_dev == out_info.st_dev && info.st_ino == out_info.st_ino) {
+            cerr << "The output directory cannot be watched: " << dirs[i] << " is " << out_dir << endl;
+            return 1;
+        }
+    }
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        cerr << "Could not start inotify: " << strerror(errno) << endl;
+        return 1;
+    }
+    vector<int> handles;
+    for (size_t i = 0; i < dirs.size(); i++) {
+        int wd = inotify_add_watch(fd, dirs[i].c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            cerr << "Could not watch " << dirs[i] << ": " << strerror(errno) << endl;
+            close(fd);
+            return 1;
+        }
+        handles.push_back(wd);
+    }
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    int workers = worker_count();
+    BoundedQueue<Arrival> arrivals(2 * workers);
+    mutex log_lock;
+    int processed = 0;
+    int failed = 0;
+    double total_ms = 0, max_ms = 0;
+    auto worker = [&] {
+        // Files are filtered side by side, so each one stays on its worker's thread
+        image_threads = 1;
+        ChainWorker chain_worker = new_chain_worker(chain);
+        Arrival arrival;
+        while (arrivals.pop(arrival)) {
+            metric_gauges.queue_depth--;
+            double queued_ms = elapsed_ms(arrival.time);
+            string error;
+            bool ok = filter_file(chain_worker, arrival.path, batch_output(out_dir, arrival.path), error);
+            double latency_ms = elapsed_ms(arrival.time);
+            lock_guard<mutex> lock(log_lock);
+            if (!ok) {
+                cerr << error << endl;
+                failed++;
+                continue;
+            }
+            processed++;
+            total_ms = total_ms + latency_ms;
+            max_ms = max(max_ms, latency_ms);
+            cout << arrival.path << ": " << latency_ms << " ms from arrival to output (queued "
+                 << queued_ms << " ms)" << endl;
+        }
+    };
+    metric_gauges.workers = workers;
+    vector<thread> threads;
+    for (int i = 0; i < workers; i++) {
+        threads.push_back(thread(worker));
+    }
+    cout << "Watching " << dirs.size() << " directories with " << workers
+         << " workers, press Ctrl-C to stop" << endl;
+
+    // Room for many events, each a header and a name
+    vector<char> events(64 * (sizeof(inotify_event) + NAME_MAX + 1));
+    chrono::steady_clock::time_point metrics_written = chrono::steady_clock::now();
+    while (!stop_requested) {
+        if (!metrics_file.empty() && elapsed_ms(metrics_written) >= 1000) {
+            write_metrics_file(metrics_file);
+            metrics_written = chrono::steady_clock::now();
+        }
+        pollfd waiting = {fd, POLLIN, 0};
+        // Wake up regularly to notice a stop request
+        if (poll(&waiting, 1, 250) <= 0) {
+            continue;
+        }
+        ssize_t length = read(fd, events.data(), events.size());
+        if (length <= 0) {
+            continue;
+        }
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        for (ssize_t offset = 0; offset < length; ) {
+            const inotify_event* event = (const inotify_event*)(events.data() + offset);
+            offset = offset + sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                lock_guard<mutex> lock(log_lock);
+                cerr << "Too many arrivals at once, some files were missed" << endl;
+                continue;
+            }
+            if (event->len == 0 || !is_bmp_name(event->name)) {
+                continue;
+            }
+            size_t dir = find(handles.begin(), handles.end(), event->wd) - handles.begin();
+            if (dir < dirs.size()) {
+                Arrival arrival = {dirs[dir] + "/" + event->name, now};
+                metric_gauges.queue_depth++;
+                arrivals.push(arrival);
+            }
+        }
+    }
+
+    arrivals.close();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    close(fd);
+    if (!metrics_file.empty()) {
+        write_metrics_file(metrics_file);
+    }
+    cout << endl;
+    cout << "Watch: " << processed << " files processed, " << failed << " failed" << endl;
+    if (processed > 0) {
+        cout << "Latency: average " << total_ms / processed << " ms, max " << max_ms << " ms" << endl;
+    }
+    return 0;
+}
+
+//**************************************************************************************************//
+//                                       Job Scheduler                                              //
+//**************************************************************************************************//
+
+// Priority classes, most urgent first
+const int JOB_INTERACTIVE = 0;
+const int JOB_BULK = 1;
+const int JOB_CLASSES = 2;
+const string job_class_names[JOB_CLASSES] = {"interactive", "bulk"};
+// Longest deadline a job can have, a day; later ones are cut to it
+const double JOB_MAX_DEADLINE_MS = 24 * 3600 * 1000.0;
+
+struct Job
+{
+    int priority;
+    // Submission order, to keep jobs without deadlines first in first out
+    long long sequence;
+    CancelToken token;
+    function<void()> work;
+    // Set once the job has run or been dropped
+    bool finished;
+    // Set if the job was cancelled or missed its deadline, before or while running
+    bool abandoned;
+};
+
+/**
+ * Orders the job queue: a more urgent class first, then the earliest deadline, then jobs
+ * without a deadline in submission order
+ * @return True if job a should run after job b
+ */
+bool job_after(const shared_ptr<Job>& a, const shared_ptr<Job>& b) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    if (a->token.has_deadline != b->token.has_deadline) {
+        return !a->token.has_deadline;
+    }
+    if (a->token.has_deadline && a->token.deadline != b->token.deadline) {
+        return a->token.deadline > b->token.deadline;
+    }
+    return a->sequence > b->sequence;
+}
+
+class JobScheduler;
+
+// The scheduler and priority of the job running on this thread, for tile checkpoints
+thread_local JobScheduler* running_scheduler = NULL;
+thread_local int running_priority = JOB_CLASSES;
+
+void scheduler_checkpoint();
+
+/**
+ * Runs jobs on a fixed pool of threads in priority and deadline order. A job is cancelled
+ * cooperatively: the engine checks its token between tiles, and the job's own thread also
+ * runs any queued job of a more urgent class before going on to the next tile, so a long
+ * bulk job is preempted at tile boundaries instead of holding its thread.
+ */
+class JobScheduler
+{
+public:
+    explicit JobScheduler(int workers) : next_sequence(0), stopping(false), preempted(0) {
+        for (int c = 0; c < JOB_CLASSES; c++) {
+            queued[c] = 0;
+            completed[c] = 0;
+            abandoned[c] = 0;
+        }
+        for (int i = 0; i < workers; i++) {
+            threads.push_back(thread([this] { work_loop(); }));
+        }
+    }
+
+    ~JobScheduler() {
+        shutdown();
+    }
+
+    /**
+     * Queues a job
+     * @param priority JOB_INTERACTIVE or JOB_BULK
+     * @param deadline_ms Milliseconds from now until the job is abandoned, or 0 for no deadline;
+     *                    at most JOB_MAX_DEADLINE_MS
+     * @param work The work to run
+     * @return the job, to wait for or cancel
+     */
+    shared_ptr<Job> submit(int priority, double deadline_ms, function<void()> work) {
+        shared_ptr<Job> job = make_shared<Job>();
+        job->priority = min(max(priority, 0), JOB_CLASSES - 1);
+        job->token.cancelled = false;
+        job->token.has_deadline = deadline_ms > 0;
+        job->token.deadline = chrono::steady_clock::now();
+        if (job->token.has_deadline) {
+            job->token.deadline += chrono::microseconds((long long)(min(deadline_ms, JOB_MAX_DEADLINE_MS) * 1000));
+        }
+        job->work = work;
+        job->finished = false;
+        job->abandoned = false;
+        lock_guard<mutex> guard(lock);
+        job->sequence = next_sequence++;
+        queue.push_back(job);
+        push_heap(queue.begin(), queue.end(), job_after);
+        queued[job->priority]++;
+        ready.notify_one();
+        return job;
+    }
+
+    // Waits for a job to finish, cancelling it at its deadline; returns false if it was abandoned
+    bool wait(const shared_ptr<Job>& job) {
+        unique_lock<mutex> guard(lock);
+        if (job->token.has_deadline) {
+            done.wait_until(guard, job->token.deadline, [&job] { return job->finished; });
+            if (!job->finished) {
+                guard.unlock();
+                cancel(job);
+                guard.lock();
+            }
+        }
+        done.wait(guard, [&job] { return job->finished; });
+        return !job->abandoned;
+    }
+
+    // Cancels a job: a queued job is dropped at once and a running one stops at its next tile
+    void cancel(const shared_ptr<Job>& job) {
+        job->token.cancelled = true;
+        lock_guard<mutex> guard(lock);
+        vector<shared_ptr<Job>>::iterator it = find(queue.begin(), queue.end(), job);
+        if (it != queue.end()) {
+            queue.erase(it);
+            make_heap(queue.begin(), queue.end(), job_after);
+            queued[job->priority]--;
+            finish(job, true);
+        }
+    }
+
+    // Runs queued jobs in a more urgent class than the one running on this thread
+    void run_urgent() {
+        int priority = running_priority;
+        for (int c = 0; c < priority; c++) {
+            while (queued[c].load(memory_order_relaxed) > 0) {
+                shared_ptr<Job> job;
+                if (!pop(priority, job)) {
+                    break;
+                }
+                preempted++;
+                run(job);
+            }
+        }
+    }
+
+    // Cancels every queued job, waits for the running ones and stops the threads
+    void shutdown() {
+        {
+            lock_guard<mutex> guard(lock);
+            if (stopping) {
+                return;
+            }
+            stopping = true;
+            for (size_t i = 0; i < queue.size(); i++) {
+                queue[i]->token.cancelled = true;
+                finish(queue[i], true);
+            }
+            queue.clear();
+            ready.notify_all();
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+
+    void report() {
+        for (int c = 0; c < JOB_CLASSES; c++) {
+            cout << "Jobs " << job_class_names[c] << ": " << completed[c] << " completed, "
+                 << abandoned[c] << " abandoned" << endl;
+        }
+        cout << "Preemptions at tile boundaries: " << preempted << endl;
+    }
+
+private:
+    // Takes the first job in a class more urgent than below; the lock must not be held
+    bool pop(int below, shared_ptr<Job>& job) {
+        lock_guard<mutex> guard(lock);
+        if (queue.empty() || queue.front()->priority >= below) {
+            return false;
+        }
+        pop_heap(queue.begin(), queue.end(), job_after);
+        job = queue.back();
+        queue.pop_back();
+        queued[job->priority]--;
+        return true;
+    }
+
+    // Marks a job finished; the lock must be held
+    void finish(const shared_ptr<Job>& job, bool dropped) {
+        job->finished = true;
+        job->abandoned = dropped;
+        if (dropped) {
+            abandoned[job->priority]++;
+        } else {
+            completed[job->priority]++;
+        }
+        done.notify_all();
+    }
+
+    void run(const shared_ptr<Job>& job) {
+        // Jobs can nest when a more urgent one preempts this thread's job
+        CancelToken* outer_job = current_job;
+        JobScheduler* outer_scheduler = running_scheduler;
+        int outer_priority = running_priority;
+        void (*outer_checkpoint)() = tile_checkpoint;
+        bool dropped = job_cancelled(&job->token);
+        if (!dropped) {
+            current_job = &job->token;
+            running_scheduler = this;
+            running_priority = job->priority;
+            tile_checkpoint = scheduler_checkpoint;
+            job->work();
+            dropped = job_cancelled(&job->token);
+        }
+        current_job = outer_job;
+        running_scheduler = outer_scheduler;
+        running_priority = outer_priority;
+        tile_checkpoint = outer_checkpoint;
+        lock_guard<mutex> guard(lock);
+        finish(job, dropped);
+    }
+
+    void work_loop() {
+        while (true) {
+            shared_ptr<Job> job;
+            {
+                unique_lock<mutex> guard(lock);
+                ready.wait(guard, [this] { return !queue.empty() || stopping; });
+                if (queue.empty()) {
+                    return;
+                }
+                pop_heap(queue.begin(), queue.end(), job_after);
+                job = queue.back();
+                queue.pop_back();
+                queued[job->priority]--;
+            }
+            run(job);
+        }
+    }
+
+    vector<thread> threads;
+    mutex lock;
+    condition_variable ready;
+    condition_variable done;
+    // A heap ordered by job_after()
+    vector<shared_ptr<Job>> queue;
+    long long next_sequence;
+    bool stopping;
+    // Jobs waiting in each class, read between tiles without taking the lock
+    atomic<int> queued[JOB_CLASSES];
+    atomic<long long> completed[JOB_CLASSES];
+    atomic<long long> abandoned[JOB_CLASSES];
+    atomic<long long> preempted;
+};
+
+void scheduler_checkpoint() {
+    if (running_scheduler != NULL) {
+        running_scheduler->run_urgent();
+    }
+}
+
+//**************************************************************************************************//
+//                                        HTTP Server                                               //
+//**************************************************************************************************//
+
+// Largest request line and headers accepted, in bytes
+const size_t HTTP_MAX_HEAD = 16 << 10;
+// Largest body accepted, in bytes
+const size_t HTTP_MAX_BODY = 256 << 20;
+// Largest image a request may decode to or have its filters produce: the most a 24 bit body
+// can hold
+const long long HTTP_MAX_PIXELS = HTTP_MAX_BODY / 3;
+// Seconds an idle keep-alive connection is held open
+const int HTTP_IDLE_SECONDS = 5;
+// Connection handlers per filter worker; handlers wait on the network and on the job
+// scheduler, and enough of them keep the scheduler's queue full enough to reorder
+const int HTTP_HANDLERS_PER_WORKER = 4;
+
+// A socket and the bytes already read from it past the end of the last message
+struct HttpConnection
+{
+    int fd;
+    vector<unsigned char> pending;
+};
+
+struct HttpRequest
+{
+    string method;
+    string path;
+    string query;
+    bool keep_alive;
+    // Keeps its storage between requests on a connection
+    vector<unsigned char> body;
+};
+
+bool send_all(int fd, const void* data, size_t size, int flags = 0) {
+    const char* next = (const char*)data;
+    while (size > 0) {
+        ssize_t sent = send(fd, next, size, flags | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        next = next + sent;
+        size = size - sent;
+    }
+    return true;
+}
+
+/**
+ * Reads a message's start line and headers
+ * @param connection The connection to read from
+ * @param head Set to the start line and headers, without the blank line that ends them
+ * @return 0 on success, -1 if the peer closed the connection or went idle, or 431 if the
+ * headers are too large
+ */
+int read_head(HttpConnection& connection, string& head) {
+    vector<unsigned char>& pending = connection.pending;
+    const char* blank_line = "\r\n\r\n";
+    size_t searched = 0;
+    while (true) {
+        vector<unsigned char>::iterator end = search(pending.begin() + searched, pending.end(),
+                                                     blank_line, blank_line + 4);
+        if (end != pending.end()) {
+            head.assign(pending.begin(), end);
+            pending.erase(pending.begin(), end + 4);
+            return 0;
+        }
+        if (pending.size() > HTTP_MAX_HEAD) {
+            return 431;
+        }
+        // The blank line may straddle what has been read and what comes next
+        searched = pending.size() < 3 ? 0 : pending.size() - 3;
+        unsigned char chunk[4096];
+        ssize_t got = recv(connection.fd, chunk, sizeof(chunk), 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        pending.insert(pending.end(), chunk, chunk + got);
+    }
+}
+
+/**
+ * Reads a message body, taking what has already arrived and then reading the rest from the
+ * socket straight into the body's storage
+ * @param connection The connection to read from
+ * @param length The size of the body in bytes
+ * @param body Set to the body
+ * @return True if the whole body arrived and false otherwise
+ */
+bool read_body(HttpConnection& connection, size_t length, vector<unsigned char>& body) {
+    vector<unsigned char>& pending = connection.pending;
+    size_t have = min(length, pending.size());
+    body.resize(length);
+    if (have > 0) {
+        memcpy(body.data(), pending.data(), have);
+        pending.erase(pending.begin(), pending.begin() + have);
+    }
+    while (have < length) {
+        ssize_t got = recv(connection.fd, body.data() + have, length - have, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        have = have + got;
+    }
+    return true;
+}
+
+/**
+ * Finds a header in a message head, ignoring the case of its name
+ * @param head The start line and headers
+ * @param name The header name in lower case
+ * @return the header's value without surrounding spaces, or "" if it is missing
+ */
+string header_value(const string& head, string name) {
+    size_t line = head.find("\r\n");
+    while (line != string::npos) {
+        line = line + 2;
+        size_t end = head.find("\r\n", line);
+        size_t colon = head.find(':', line);
+        if (colon != string::npos && (end == string::npos || colon < end)
+            && colon - line == name.size()) {
+            bool match = true;
+            for (size_t i = 0; i < name.size(); i++) {
+                match = match && tolower(head[line + i]) == name[i];
+            }
+            if (match) {
+                size_t first = head.find_first_not_of(" \t", colon + 1);
+                string value = first == string::npos || (end != string::npos && first >= end)
+                    ? "" : head.substr(first, end == string::npos ? string::npos : end - first);
+                return value.substr(0, value.find_last_not_of(" \t") + 1);
+            }
+        }
+        line = end;
+    }
+    return "";
+}
+
+// Lower cases a header value for comparison
+string lower_case(string text) {
+    for (size_t i = 0; i < text.size(); i++) {
+        text[i] = tolower(text[i]);
+    }
+    return text;
+}
+
+/**
+ * Reads the next request from a connection. Bodies must have a Content-Length.
+ * @param connection The connection to read from
+ * @param request Set to the request
+ * @return 0 on success, -1 if the client closed the connection or went idle, or the HTTP status
+ * to fail with
+ */
+int read_request(HttpConnection& connection, HttpRequest& request) {
+    string head;
+    int status = read_head(connection, head);
+    if (status != 0) {
+        return status;
+    }
+    stringstream start_line(head.substr(0, head.find("\r\n")));
+    string target, version;
+    start_line >> request.method >> target >> version;
+    if (target.empty() || version.compare(0, 5, "HTTP/") != 0) {
+        return 400;
+    }
+    size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    request.query = question == string::npos ? "" : target.substr(question + 1);
+    string connection_header = lower_case(header_value(head, "connection"));
+    request.keep_alive = version == "HTTP/1.1" ? connection_header != "close"
+                                               : connection_header == "keep-alive";
+    if (!header_value(head, "transfer-encoding").empty()) {
+        return 411;
+    }
+    string length_header = header_value(head, "content-length");
+    if (length_header.empty()) {
+        request.body.clear();
+        return request.method == "POST" ? 411 : 0;
+    }
+    unsigned long long length = strtoull(length_header.c_str(), NULL, 10);
+    if (length > HTTP_MAX_BODY) {
+        return 413;
+    }
+    return read_body(connection, length, request.body) ? 0 : -1;
+}
+
+/**
+ * Finds a parameter in a query string, undoing its percent encoding
+ * @param query The query string, such as chain=greyscale%2Clighten%3A0.5
+ * @param name The parameter name
+ * @return the parameter's value, or "" if it is missing
+ */
+string query_param(const string& query, string name) {
+    stringstream params(query);
+    string param;
+    while (getline(params, param, '&')) {
+        if (param.compare(0, name.size() + 1, name + "=") != 0) {
+            continue;
+        }
+        string value;
+        for (size_t i = name.size() + 1; i < param.size(); i++) {
+            if (param[i] == '%' && i + 2 < param.size() && isxdigit(param[i + 1]) && isxdigit(param[i + 2])) {
+                value += (char)strtol(param.substr(i + 1, 2).c_str(), NULL, 16);
+                i = i + 2;
+            } else {
+                value += param[i] == '+' ? ' ' : param[i];
+            }
+        }
+        return value;
+    }
+    return "";
+}
+
+string http_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+bool send_response(int fd, int status, string content_type, const unsigned char* body, size_t size,
+                   bool keep_alive) {
+    string head = "HTTP/1.1 " + to_string(status) + " " + http_reason(status) + "\r\n"
+        + "Content-Type: " + content_type + "\r\n"
+        + "Content-Length: " + to_string(size) + "\r\n"
+        + "Connection: " + (keep_alive ? "keep-alive" : "close") + "\r\n\r\n";
+    // MSG_MORE holds the head back so it leaves in the same packet as the start of the body
+    return send_all(fd, head.data(), head.size(), size > 0 ? MSG_MORE : 0)
+        && send_all(fd, body, size);
+}
+
+bool send_text(int fd, int status, string text, bool keep_alive) {
+    return send_response(fd, status, "text/plain", (const unsigned char*)text.data(), text.size(),
+                         keep_alive);
+}
+
+// A server thread's filter states and buffers, kept for as long as clients send the same chain
+struct ServeWorker
+{
+    string chain_text;
+    ChainWorker chain;
+    // Runs the filters of every request
+    JobScheduler* scheduler;
+};
+
+/**
+ * Handles one request. POST /filter?chain=FILTER[,FILTER...] with a BMP or binary PPM body
+ * responds with the filtered image in the same format; GET /health responds with "ok" and
+ * GET /metrics with the metrics in the Prometheus text format. A filter request may add
+ * priority=interactive or priority=bulk (interactive by default) and deadline_ms=N, after
+ * which it is abandoned with 503.
+ * @param request The request
+ * @param worker The thread's filter states and buffers
+ * @param content_type Set to the type of the response body
+ * @param text Set to the response body when it is not an image
+ * @return the HTTP status, with the response in worker.chain.buffer when content_type is an image
+ */
+int handle_request(const HttpRequest& request, ServeWorker& worker, string& content_type, string& text) {
+    content_type = "text/plain";
+    if (request.path == "/health") {
+        text = "ok\n";
+        return 200;
+    }
+    if (request.path == "/metrics") {
+        content_type = "text/plain; version=0.0.4";
+        text = render_metrics();
+        return 200;
+    }
+    if (request.path != "/filter") {
+        text = "Unknown path " + request.path + "\n";
+        return 404;
+    }
+    if (request.method != "POST") {
+        text = "Use POST with an image body\n";
+        return 405;
+    }
+    string chain_text = query_param(request.query, "chain");
+    MetricShard& shard = metric_shard();
+    count_metric(chain_text == worker.chain_text ? shard.chain_hits : shard.chain_misses, 1);
+    if (chain_text != worker.chain_text) {
+        vector<FilterSpec> chain;
+        if (!parse_filter_chain(chain_text, chain)) {
+            text = "Bad filter chain " + chain_text + "\n";
+            return 400;
+        }
+        worker.chain = new_chain_worker(chain);
+        worker.chain_text = chain_text;
+    }
+    ChainWorker& chain = worker.chain;
+    const unsigned char* body = request.body.data();
+    size_t size = request.body.size();
+    bool ppm = size >= 2 && body[0] == 'P' && body[1] == '6';
+    if (ppm ? !decode_ppm(body, size, chain.image) : !decode_image(body, size, chain.image)) {
+        text = "The body is not a BMP or binary PPM image\n";
+        return 415;
+    }
+    // Enlargements multiply the image, so the largest it gets is bounded before the filters
+    // allocate anything. Each factor is at most ENLARGE_MAX_FACTOR, so this cannot overflow.
+    long long pixels = (long long)chain.image.size() * (chain.image.empty() ? 0 : chain.image[0].size());
+    for (size_t k = 0; k < chain.states.size() && pixels <= HTTP_MAX_PIXELS; k++) {
+        const FilterSpec& spec = chain.states[k].spec;
+        if (spec.selection == 6) {
+            pixels = pixels * spec.x_scale * spec.y_scale;
+        }
+    }
+    if (pixels > HTTP_MAX_PIXELS) {
+        text = "The filtered image would be over " + to_string(HTTP_MAX_PIXELS) + " pixels\n";
+        return 413;
+    }
+    int priority = query_param(request.query, "priority") == "bulk" ? JOB_BULK : JOB_INTERACTIVE;
+    double deadline_ms = atof(query_param(request.query, "deadline_ms").c_str());
+    if (!isfinite(deadline_ms) || deadline_ms < 0) {
+        text = "Bad deadline_ms\n";
+        return 400;
+    }
+    // A scheduler thread runs the filters, so anything they throw is caught there and passed back
+    exception_ptr failure;
+    shared_ptr<Job> job = worker.scheduler->submit(priority, deadline_ms, [&chain, &failure] {
+        try {
+            run_chain(chain);
+        } catch (...) {
+            failure = current_exception();
+        }
+    });
+    if (!worker.scheduler->wait(job)) {
+        text = "Abandoned: cancelled or past its deadline\n";
+        return 503;
+    }
+    if (failure) {
+        rethrow_exception(failure);
+    }
+    if (ppm) {
+        encode_ppm(chain.image, chain.buffer);
+        content_type = "image/x-portable-pixmap";
+    } else {
+        encode_image(chain.image, chain.buffer);
+        content_type = "image/bmp";
+    }
+    return 200;
+}
+
+/**
+ * Serves one connection's requests until it has none waiting, it asks to close or it fails
+ * @param connection The connection, with a request arriving
+ * @param worker The thread's filter states and buffers
+ * @param request Scratch space for the request, reused between calls
+ * @param failures Counts requests that failed
+ * @return the number of requests served, negative if the connection should be closed
+ */
+long long serve_connection(HttpConnection& connection, ServeWorker& worker, HttpRequest& request,
+                           atomic<long long>& failures) {
+    string content_type, text;
+    long long served = 0;
+    do {
+        int status = read_request(connection, request);
+        if (status < 0) {
+            return -1 - served;
+        }
+        if (status > 0) {
+            // The rest of the stream cannot be trusted after a malformed request
+            send_text(connection.fd, status, http_reason(status) + "\n", false);
+            failures++;
+            return -1 - served;
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        metric_gauges.busy_workers++;
+        // A request that runs out of memory or hits a filter's limits fails alone, not the server.
+        // The chain's states may be half built, so they are made afresh for the next request.
+        try {
+            status = handle_request(request, worker, content_type, text);
+        } catch (const bad_alloc&) {
+            worker.chain_text = "";
+            worker.chain = new_chain_worker(vector<FilterSpec>());
+            content_type = "text/plain";
+            text = "The image is too large to filter\n";
+            status = 413;
+        } catch (const exception& error) {
+            worker.chain_text = "";
+            worker.chain = new_chain_worker(vector<FilterSpec>());
+            content_type = "text/plain";
+            text = string("Could not filter the image: ") + error.what() + "\n";
+            status = 400;
+        }
+        served++;
+        bool sent;
+        MetricShard& shard = metric_shard();
+        if (content_type.compare(0, 6, "image/") == 0) {
+            const vector<unsigned char>& image = worker.chain.buffer;
+            sent = send_response(connection.fd, status, content_type, image.data(), image.size(),
+                                 request.keep_alive);
+            double ms = elapsed_ms(start);
+            count_metric(shard.images, 1);
+            count_metric(shard.bytes_in, request.body.size());
+            count_metric(shard.bytes_out, image.size());
+            observe_latency(shard.image_latency, ms);
+        } else {
+            failures += status != 200;
+            count_metric(shard.failures, status != 200);
+            sent = send_response(connection.fd, status, content_type, (const unsigned char*)text.data(),
+                                 text.size(), request.keep_alive);
+        }
+        count_metric(shard.busy_us, (long long)(elapsed_ms(start) * 1000));
+        metric_gauges.busy_workers--;
+        if (!sent || !request.keep_alive) {
+            return -1 - served;
+        }
+    // Pipelined requests are already waiting in the connection's buffer
+    } while (!connection.pending.empty());
+    return served;
+}
+
+/**
+ * Serves filter requests on a local port until SIGINT or SIGTERM. The calling thread waits on
+ * the listening socket and every idle keep-alive connection with poll(); a connection with a
+ * request arriving is handed to a pool of handler threads, which return it once served.
+ * Handlers decode and encode, and queue the filters on a job scheduler with a fixed number of
+ * workers. Many clients can keep connections open while the number of images filtered at once
+ * stays bounded, and urgent requests overtake bulk ones.
+ * @param port The TCP port to listen on, on the loopback interface
+ * @param workers The number of requests filtered at once
+ * @return the process exit code
+ */
+int run_server(int port, int workers) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int wake[2];
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener, 128) != 0 || pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        cerr << "Could not listen on port " << port << ": " << strerror(errno) << endl;
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    JobScheduler scheduler(workers);
+    int handlers = HTTP_HANDLERS_PER_WORKER * workers;
+    BoundedQueue<HttpConnection*> ready(handlers);
+    // Connections handlers have finished with, waiting to go back to the idle set
+    vector<HttpConnection*> returned;
+    mutex returned_lock;
+    atomic<long long> requests(0);
+    atomic<long long> failures(0);
+    auto worker = [&] {
+        ServeWorker serve_worker;
+        serve_worker.scheduler = &scheduler;
+        HttpRequest request;
+        HttpConnection* connection;
+        while (ready.pop(connection)) {
+            metric_gauges.queue_depth--;
+            long long served = serve_connection(*connection, serve_worker, request, failures);
+            requests += served < 0 ? -1 - served : served;
+            if (served < 0) {
+                close(connection->fd);
+                delete connection;
+                metric_gauges.connections--;
+                continue;
+            }
+            lock_guard<mutex> lock(returned_lock);
+            returned.push_back(connection);
+            char byte = 0;
+            if (write(wake[1], &byte, 1) < 0) {
+                // The pipe is already full of wake ups
+            }
+        }
+    };
+    // Busy time is counted per handler, since handlers decode and encode as well as wait on the
+    // filters, so utilization is busy time over the handler count
+    metric_gauges.workers = handlers;
+    vector<thread> threads;
+    for (int i = 0; i < handlers; i++) {
+        threads.push_back(thread(worker));
+    }
+    cout << "Serving on http://127.0.0.1:" << port << "/filter?chain=FILTER[,FILTER...] with "
+         << workers << " workers, press Ctrl-C to stop" << endl;
+
+    // Bodies must keep arriving once a request has started
+    timeval idle = {HTTP_IDLE_SECONDS, 0};
+    vector<HttpConnection*> idle_connections;
+    vector<chrono::steady_clock::time_point> idle_since;
+    vector<pollfd> waiting;
+    while (!stop_requested) {
+        waiting.clear();
+        pollfd wake_fd = {wake[0], POLLIN, 0};
+        pollfd listen_fd = {listener, POLLIN, 0};
+        waiting.push_back(wake_fd);
+        waiting.push_back(listen_fd);
+        for (size_t i = 0; i < idle_connections.size(); i++) {
+            pollfd connection_fd = {idle_connections[i]->fd, POLLIN, 0};
+            waiting.push_back(connection_fd);
+        }
+        // Wake up regularly to notice a stop request and idle connections
+        if (poll(waiting.data(), waiting.size(), 250) < 0) {
+            continue;
+        }
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+        // Hand out connections with a request arriving and drop the ones idle too long
+        size_t kept = 0;
+        for (size_t i = 0; i < idle_connections.size(); i++) {
+            HttpConnection* connection = idle_connections[i];
+            if (waiting[i + 2].revents != 0) {
+                metric_gauges.queue_depth++;
+                ready.push(connection);
+            } else if (now - idle_since[i] > chrono::seconds(HTTP_IDLE_SECONDS)) {
+                close(connection->fd);
+                delete connection;
+                metric_gauges.connections--;
+            } else {
+                idle_connections[kept] = connection;
+                idle_since[kept] = idle_since[i];
+                kept++;
+            }
+        }
+        idle_connections.resize(kept);
+        idle_since.resize(kept);
+
+        if (waiting[0].revents != 0) {
+            char bytes[256];
+            while (read(wake[0], bytes, sizeof(bytes)) > 0) {
+            }
+            lock_guard<mutex> lock(returned_lock);
+            idle_connections.insert(idle_connections.end(), returned.begin(), returned.end());
+            idle_since.resize(idle_connections.size(), now);
+            returned.clear();
+        }
+        if (waiting[1].revents != 0) {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+                HttpConnection* connection = new HttpConnection();
+                connection->fd = fd;
+                metric_gauges.connections++;
+                idle_connections.push_back(connection);
+                idle_since.push_back(now);
+            }
+        }
+    }
+
+    close(listener);
+    ready.close();
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    idle_connections.insert(idle_connections.end(), returned.begin(), returned.end());
+    for (size_t i = 0; i < idle_connections.size(); i++) {
+        close(idle_connections[i]->fd);
+        delete idle_connections[i];
+    }
+    metric_gauges.connections = 0;
+    close(wake[0]);
+    close(wake[1]);
+    cout << endl;
+    scheduler.shutdown();
+    cout << "Served " << requests << " requests, " << failures << " failed" << endl;
+    scheduler.report();
+    return 0;
+}
+
+// The value below which the given fraction of the sorted values fall
+double percentile(const vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[min(index, sorted.size() - 1)];
+}
+
+/**
+ * Sends filter requests to a local server over keep-alive connections and reports the request
+ * rate and latency percentiles
+ * @param port The server's port on the loopback interface
+ * @param filename The image to send with every request
+ * @param chain_text The filter chain to ask for
+ * @param clients The number of connections sending requests at once
+ * @param total The number of requests to send
+ * @return the process exit code
+ */
+int run_load(int port, string filename, string chain_text, int clients, int total) {
+    vector<unsigned char> image;
+    if (!read_file(filename, image)) {
+        cerr << "Could not read " << filename << endl;
+        return 1;
+    }
+    string head = "POST /filter?chain=" + chain_text + " HTTP/1.1\r\n"
+        + "Host: 127.0.0.1:" + to_string(port) + "\r\n"
+        + "Content-Length: " + to_string(image.size()) + "\r\n\r\n";
+
+    atomic<int> next_request(0);
+    atomic<int> errors(0);
+    atomic<long long> received(0);
+    vector<vector<double>> latencies(clients);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    auto client = [&](int id) {
+        HttpConnection connection;
+        connection.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address = sockaddr_in();
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connection.fd < 0 || connect(connection.fd, (sockaddr*)&address, sizeof(address)) != 0) {
+            errors++;
+            if (connection.fd >= 0) {
+                close(connection.fd);
+            }
+            return;
+        }
+        int on = 1;
+        setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        string response_head;
+        vector<unsigned char> body;
+        while (next_request++ < total) {
+            chrono::steady_clock::time_point sent = chrono::steady_clock::now();
+            if (!send_all(connection.fd, head.data(), head.size(), MSG_MORE)
+                || !send_all(connection.fd, image.data(), image.size())
+                || read_head(connection, response_head) != 0
+                || !read_body(connection, strtoull(header_value(response_head, "content-length").c_str(), NULL, 10), body)) {
+                errors++;
+                break;
+            }
+            latencies[id].push_back(elapsed_ms(sent));
+            received += body.size();
+            if (response_head.compare(0, 12, "HTTP/1.1 200") != 0) {
+                errors++;
+            }
+        }
+        close(connection.fd);
+    };
+    vector<thread> threads;
+    for (int i = 0; i < clients; i++) {
+        threads.push_back(thread(client, i));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    double seconds = elapsed_ms(start) / 1000.0;
+
+    vector<double> all;
+    for (int i = 0; i < clients; i++) {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    }
+    sort(all.begin(), all.end());
+    cout << "Requests: " << all.size() << " completed, " << errors << " errors, " << clients
+         << " connections" << endl;
+    cout << "Throughput: " << all.size() / seconds << " requests/sec, "
+         << (all.size() * image.size() + received) / seconds / 1e6 << " MB/s in and out" << endl;
+    cout << "Latency: p50 " << percentile(all, 0.5) << " ms, p90 " << percentile(all, 0.9)
+         << " ms, p99 " << percentile(all, 0.99) << " ms, max " << (all.empty() ? 0 : all.back())
+         << " ms" << endl;
+    return errors == 0 ? 0 : 1;
+}
+
+//**************************************************************************************************//
+//                                         "Router"                                                 //
+//**************************************************************************************************//
+
+const Process proc_arr[10] = {
+        &process_1,
+        &process_2,
+        &process_3,
+        &process_4,
+        &process_5,
+        &process_6,
+        &process_7,
+        &process_8,
+        &process_9,
+        &process_10
+};
+const string filter_arr[10] = {
+        "vignette",
+        "clarendon",
+        "greyscale",
+        "rotate 90 degrees",
+        "rotate multiple 90 degrees",
+        "enlarge",
+        "high contrast",
+        "lighten",
+        "darken",
+        "black, white, red, green, blue"
+};
+
+string map_selection(int s, string current_file) {
+    if (s == 11) {
+        cout << "Change image selected" << endl;
+        return get_input_filename();
+    }
+    if (s == 12) {
+        run_sequence();
+        return current_file;
+    }
+    if (s == 13) {
+        gallery(current_file);
+        return current_file;
+    }
+    execute(current_file, filter_arr[s-1], proc_arr[s-1]);
+    return current_file;
+}
+
+//**************************************************************************************************//
+//                                         Benchmarks                                               //
+//**************************************************************************************************//
+
+/**
+ * Times a piece of work, repeating it until enough time has passed for a stable reading
+ * @param work The work to time
+ * @return the average time of one run in milliseconds
+ */
+template <typename Work>
+double time_ms(Work work) {
+    int runs = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    do {
+        work();
+        runs++;
+    } while (runs < 3 || elapsed_ms(start) < 200);
+    return elapsed_ms(start) / runs;
+}
+
+/**
+ * Compresses the pixel array of each point-wise filter's output and reports the compression
+ * ratio and throughput
+ * @param image The image to filter
+ * @return the process exit code
+ */
+int bench_lz(const Image& image) {
+    const int filters[] = {1, 2, 3, 7, 8, 9, 10};
+    vector<unsigned char> bmp, packed, unpacked;
+    cout << "filter                           ratio   compress MB/s   decompress MB/s" << endl;
+    for (int i = 0; i < 7; i++) {
+        FilterSpec spec = new_spec(filters[i]);
+        spec.scale = 0.5;
+        Image new_image = apply_filter(image, spec);
+        encode_image(new_image, bmp);
+        double mb = bmp.size() / 1e6;
+        double compress_ms = time_ms([&] { lz_compress(bmp.data(), bmp.size(), packed); });
+        unpacked.resize(bmp.size());
+        double decompress_ms = time_ms([&] {
+            lz_decompress(packed.data(), packed.size(), unpacked.data(), unpacked.size());
+        });
+        if (unpacked != bmp) {
+            cerr << "Round trip failed for filter " << filters[i] << endl;
+            return 1;
+        }
+        string name = to_string(filters[i]) + ") " + filter_arr[filters[i] - 1];
+        name.resize(32, ' ');
+        cout << name << " " << (double)bmp.size() / packed.size() << "   "
+             << mb / (compress_ms / 1000) << "   " << mb / (decompress_ms / 1000) << endl;
+    }
+    return 0;
+}
+
+/**
+ * Compares ordinary and non-temporal stores on outputs much larger than the cache: enlarging
+ * the image 8x8 and converting that enlargement to greyscale
+ * @param image The image to enlarge
+ * @return the process exit code
+ */
+int bench_stores(const Image& image) {
+    size_t saved_threshold = streaming_store_bytes;
+    Image big, enlarged, grey;
+    enlarge(image, big, 8, 8);
+    int rows, cols;
+    tie(rows, cols) = size_image(big);
+    double mb = (double)rows * cols * sizeof(Pixel) / 1e6;
+    cout << "output " << cols << "x" << rows << " (" << mb << " MB)" << endl;
+    cout << "kernel        cached MB/s   streaming MB/s" << endl;
+    double rates[2][2];
+    for (int streaming = 0; streaming < 2; streaming++) {
+        streaming_store_bytes = streaming ? 0 : numeric_limits<size_t>::max();
+        double enlarge_ms = time_ms([&] { enlarge(image, enlarged, 8, 8); });
+        double grey_ms = time_ms([&] { map_pixels(big, grey, greyscale_pixel); });
+        rates[0][streaming] = mb / (enlarge_ms / 1000);
+        // Greyscale reads the input and writes the output
+        rates[1][streaming] = 2 * mb / (grey_ms / 1000);
+    }
+    streaming_store_bytes = saved_threshold;
+    cout << "enlarge 8x8   " << rates[0][0] << "   " << rates[0][1] << endl;
+    cout << "greyscale     " << rates[1][0] << "   " << rates[1][1] << endl;
+    return 0;
+}
+
+// A quarter turn as a plain loop over the input, the way rotate_90() first did it
+Image rotate_loop(const Image& image) {
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    Image new_image(cols, vector<Pixel> (rows));
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            new_image[(cols - 1) - col][row] = image[row][col];
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Compares the quarter turn kernels: the plain loop, square blocks of several sizes and the
+ * recursive split, from images that fit in the L2 cache to images ten times the last level cache.
+ * Half turns are compared with a plain copy, which they should nearly match.
+ * @param image The image to tile into the test images
+ * @return the process exit code
+ */
+int bench_rotate(const Image& image) {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    l2 = l2 > 0 ? l2 : 1 << 20;
+    llc = llc > 0 ? llc : 8 << 20;
+    // Input and output together are about these sizes
+    const double sizes[] = {l2 / 2.0, llc / 2.0, 2.0 * llc, 10.0 * llc};
+    const int blocks[] = {16, 32, 64};
+    int saved_kernel = rotate_kernel, saved_block = rotate_block;
+    cout << "L2 " << (l2 >> 10) << " KB, last level cache " << (llc >> 10) << " KB; megapixels/s" << endl;
+    cout << "image         loop     block 16  block 32  block 64  recursive" << endl;
+    for (int i = 0; i < 4; i++) {
+        int side = max(8, (int)sqrt(sizes[i] / (2 * sizeof(Pixel))));
+        // The test image repeats the input so the pixels are not all alike
+        Image test(side, vector<Pixel> (side));
+        for (int row = 0; row < side; row++) {
+            const vector<Pixel>& src = image[row % image.size()];
+            for (int col = 0; col < side; col++) {
+                test[row][col] = src[col % src.size()];
+            }
+        }
+        double mp = (double)side * side / 1e6;
+        Image rotated;
+        string label = to_string(side) + "x" + to_string(side);
+        label.resize(12, ' ');
+        cout << label << "  " << mp / (time_ms([&] { rotated = rotate_loop(test); }) / 1000);
+        rotate_kernel = ROTATE_BLOCKED;
+        for (int b = 0; b < 3; b++) {
+            rotate_block = blocks[b];
+            cout << "  " << mp / (time_ms([&] { rotated = rotate_90(test, 1); }) / 1000);
+        }
+        rotate_kernel = ROTATE_RECURSIVE;
+        cout << "  " << mp / (time_ms([&] { rotated = rotate_90(test, 1); }) / 1000) << endl;
+    }
+    rotate_kernel = saved_kernel;
+    rotate_block = saved_block;
+
+    cout << "half turn     copy     reverse_copy  reversed  in place" << endl;
+    for (int i = 0; i < 4; i++) {
+        int side = max(8, (int)sqrt(sizes[i] / (2 * sizeof(Pixel))));
+        Image test(side, vector<Pixel> (side)), rotated(side, vector<Pixel> (side));
+        for (int row = 0; row < side; row++) {
+            for (int col = 0; col < side; col++) {
+                test[row][col] = image[row % image.size()][col % image[0].size()];
+            }
+        }
+        double mp = (double)side * side / 1e6;
+        string label = to_string(side) + "x" + to_string(side);
+        label.resize(12, ' ');
+        cout << label << "  " << mp / (time_ms([&] {
+            for (int row = 0; row < side; row++) {
+                memcpy(rotated[row].data(), test[row].data(), side * sizeof(Pixel));
+            }
+        }) / 1000);
+        cout << "  " << mp / (time_ms([&] {
+            for (int row = 0; row < side; row++) {
+                reverse_copy(test[row].begin(), test[row].end(), rotated[(side - 1) - row].begin());
+            }
+        }) / 1000);
+        cout << "  " << mp / (time_ms([&] { rotate_180(test, rotated); }) / 1000);
+        cout << "  " << mp / (time_ms([&] { rotate_180_in_place(test); }) / 1000) << endl;
+    }
+    return 0;
+}
+
+// Cycles of the time stamp counter where the CPU has one, otherwise nanoseconds
+uint64_t cycle_count() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// A transpose kernel as timed by bench_transpose()
+struct TransposeKernel
+{
+    string name;
+    int block;
+    int pixel_bytes;
+    void (*run)(const unsigned char*, ptrdiff_t, unsigned char*, ptrdiff_t);
+};
+
+/**
+ * Measures the transpose kernels in pixels per cycle, each transposing a square small enough
+ * to stay in the L2 cache block by block, then compares encoding with the rotation applied on
+ * write against rotating and then encoding
+ * @param image The image to fill the squares with and to encode
+ * @return the process exit code
+ */
+int bench_transpose(const Image& image) {
+    const int side = 256;
+    const TransposeKernel kernels[] = {
+        {"4x4 32-bit scalar", 4, 4, transpose_4x4_32_scalar},
+        {"4x4 32-bit", 4, 4, transpose_4x4_32},
+        {"8x8 32-bit", 8, 4, transpose_8x8_32},
+        {"4x4 24-bit scalar", 4, 3, transpose_4x4_24_scalar},
+        {"4x4 24-bit", 4, 3, transpose_4x4_24}};
+#if defined(__AVX2__)
+    cout << "SIMD: AVX2";
+#elif defined(__SSSE3__)
+    cout << "SIMD: SSSE3";
+#elif defined(__SSE2__)
+    cout << "SIMD: SSE2";
+#elif defined(__ARM_NEON)
+    cout << "SIMD: NEON";
+#else
+    cout << "SIMD: none";
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    cout << "; pixels per time stamp counter cycle" << endl;
+#else
+    cout << "; pixels per nanosecond" << endl;
+#endif
+    vector<unsigned char> src(side * side * 4), dst(side * side * 4);
+    for (size_t i = 0; i < src.size(); i++) {
+        const Pixel& p = image[i / 4 / side % image.size()][i / 4 % side % image[0].size()];
+        src[i] = i % 4 == 0 ? p.blue : i % 4 == 1 ? p.green : p.red;
+    }
+    for (int k = 0; k < 5; k++) {
+        const TransposeKernel& kernel = kernels[k];
+        ptrdiff_t stride = (ptrdiff_t)side * kernel.pixel_bytes;
+        auto pass = [&] {
+            for (int top = 0; top < side; top += kernel.block) {
+                for (int left = 0; left < side; left += kernel.block) {
+                    kernel.run(src.data() + top * stride + left * kernel.pixel_bytes, stride,
+                               dst.data() + left * stride + top * kernel.pixel_bytes, stride);
+                }
+            }
+        };
+        pass();
+        const int passes = 200;
+        uint64_t start = cycle_count();
+        for (int i = 0; i < passes; i++) {
+            pass();
+        }
+        uint64_t cycles = cycle_count() - start;
+        string name = kernel.name;
+        name.resize(20, ' ');
+        cout << name << (double)side * side * passes / max(cycles, (uint64_t)1) << endl;
+    }
+
+    int rows, cols;
+    tie(rows, cols) = size_image(image);
+    double mp = (double)rows * cols / 1e6;
+    vector<unsigned char> buffer;
+    cout << "quarter turn and encode " << cols << "x" << rows << ", megapixels/s" << endl;
+    cout << "rotate, then encode  " << mp / (time_ms([&] { encode_image(rotate_90(image, 1), buffer); }) / 1000) << endl;
+    cout << "encode rotated       " << mp / (time_ms([&] { encode_rotated(image, 1, buffer); }) / 1000) << endl;
+    return 0;
+}
+
+/**
+ * Reads the image a benchmark runs on, or generates it when it is named gen:KIND:SIZE[:SEED]
+ * @param name The BMP file or synthetic image
+ * @return the image, empty if it could not be read
+ */
+Image benchmark_image(string name) {
+    CorpusSpec spec;
+    if (name.compare(0, 4, "gen:") == 0) {
+        return parse_corpus_spec(name.substr(4), spec) ? generate_image(spec) : Image();
+    }
+    return read_image(name);
+}
+
+int command_bench(const vector<string>& args) {
+    string suite = args[0];
+    Image image = benchmark_image(args.size() > 1 ? args[1] : "sample.bmp");
+    if (image.empty()) {
+        cerr << "Benchmarks need a valid BMP image" << endl;
+        return 1;
+    }
+    if (suite == "lz") {
+        return bench_lz(image);
+    }
+    if (suite == "stores") {
+        return bench_stores(image);
+    }
+    if (suite == "rotate") {
+        return bench_rotate(image);
+    }
+    if (suite == "transpose") {
+        return bench_transpose(image);
+    }
+    cerr << "Unknown benchmark " << suite << endl;
+    return 1;
+}
+
+//**************************************************************************************************//
+//                                         Autotuner                                                //
+//**************************************************************************************************//
+
+// The profile file read at startup, in the home directory, unless HORN_PROFILE names another.
+// Never the working directory, so where a command runs does not change how it runs.
+const string DEFAULT_PROFILE = ".horn.profile";
+// Largest tile, block and band sides and thread count a profile may set
+const long long PROFILE_MAX_SIDE = 4096;
+const long long PROFILE_MAX_THREADS = 1024;
+// Variants sweeps are timed with
+const int TUNE_VARIANTS = 8;
+
+// The profile to read and save, or "" if there is no home directory to keep it in
+string profile_path() {
+    const char* path = getenv("HORN_PROFILE");
+    if (path != NULL && path[0] != '\0') {
+        return path;
+    }
+    const char* home = getenv("HOME");
+    return home != NULL && home[0] != '\0' ? string(home) + "/" + DEFAULT_PROFILE : "";
+}
+
+/**
+ * Loads engine settings from a profile: lines of a setting name and a value, with # starting
+ * a comment. Unknown names and bad or out of range values are skipped with a warning.
+ * @param filename The profile
+ * @return True if the profile was read and false if there is none
+ */
+bool load_profile(string filename) {
+    ifstream in(filename);
+    if (filename.empty() || !in.is_open()) {
+        return false;
+    }
+    string line;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        string name;
+        long long value;
+        if (!(fields >> name)) {
+            continue;
+        }
+        bool valid = (bool)(fields >> value) && value >= 0;
+        if (valid && name == "tile_size" && value > 0 && value <= PROFILE_MAX_SIDE) {
+            tile_size = value;
+        } else if (valid && name == "rotate_kernel" && value <= ROTATE_RECURSIVE) {
+            rotate_kernel = value;
+        } else if (valid && name == "rotate_block" && value > 0 && value <= PROFILE_MAX_SIDE) {
+            rotate_block = value;
+        } else if (valid && name == "band_rows" && value > 0 && value <= PROFILE_MAX_SIDE) {
+            band_rows = value;
+        } else if (valid && name == "threads" && value <= PROFILE_MAX_THREADS) {
+            thread_count = value;
+        } else if (valid && name == "streaming_stores" && value <= 1) {
+            streaming_store_bytes = value ? 32 << 20 : numeric_limits<size_t>::max();
+        } else {
+            cerr << filename << ": skipping " << line << endl;
+        }
+    }
+    engine_profile = filename;
+    return true;
+}
+
+/**
+ * Saves the engine settings as a profile, written to a temporary file renamed into place
+ * @param filename The profile
+ * @return True if the profile was saved and false otherwise
+ */
+bool save_profile(string filename) {
+    ostringstream out;
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&now));
+    out << "# Engine settings tuned by main autotune on " << date << ", "
+        << thread::hardware_concurrency() << " cores\n";
+    out << "tile_size " << tile_size << "\n";
+    out << "rotate_kernel " << rotate_kernel << "\n";
+    out << "rotate_block " << rotate_block << "\n";
+    out << "band_rows " << band_rows << "\n";
+    out << "threads " << thread_count << "\n";
+    out << "streaming_stores " << (streaming_store_bytes != numeric_limits<size_t>::max()) << "\n";
+    string text = out.str();
+    if (filename.empty()) {
+        return false;
+    }
+    return write_file(filename, (const unsigned char*)text.data(), text.size());
+}
+
+/**
+ * Times a setting at each candidate value and leaves it at the fastest. The current value is
+ * kept unless another is more than 3% faster, so timing noise does not move settings around.
+ * @param name The setting, as shown
+ * @param setting The setting
+ * @param candidates The values to try
+ * @param work The work to time
+ * @return nothing
+ */
+template <typename Setting, typename Work>
+void tune(string name, Setting& setting, const vector<Setting>& candidates, Work work) {
+    Setting current = setting, best = setting;
+    double best_ms = numeric_limits<double>::max(), current_ms = best_ms;
+    cout << name << ":";
+    for (size_t i = 0; i < candidates.size(); i++) {
+        setting = candidates[i];
+        double ms = time_ms(work);
+        cout << " " << candidates[i] << "=" << ms << "ms";
+        if (ms < best_ms) {
+            best_ms = ms;
+            best = candidates[i];
+        }
+        if (candidates[i] == current) {
+            current_ms = ms;
+        }
+    }
+    setting = current_ms <= best_ms * 1.03 ? current : best;
+    cout << " -> " << setting << endl;
 }
 
-Image rotate_90(const Image& image, int rotations) {
-    // 4 is a 360 so true number of spins is num % 4
-    rotations = rotations % 4;
-    if (rotations == 0) {
-        return image;
+/**
+ * Benchmarks the engine settings on this host and saves the fastest to the profile. The image
+ * is enlarged until it is much larger than the caches, so the settings are chosen for images
+ * that do not fit in them.
+ * @param image The image to tune with
+ * @param filename The profile to save
+ * @return the process exit code
+ */
+int run_autotune(const Image& image, string filename) {
+    Image big = image, output;
+    while ((size_t)big.size() * big[0].size() * sizeof(Pixel) < (64u << 20)) {
+        enlarge(big, output, 2, 2);
+        swap(big, output);
     }
     int rows, cols;
-    tie(rows, cols) = size_image(image);
-    Image new_image(cols, vector<Pixel> (rows));
-    Image new_image_mirror(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            Pixel p = image[row][col];
-            new_image[(cols - 1) - col][row] = p;
-        }
+    tie(rows, cols) = size_image(big);
+    cout << "Tuning on " << cols << "x" << rows << ", " << thread::hardware_concurrency() << " cores" << endl;
+
+    FilterState clarendon = new_state(new_spec(2));
+    clarendon.spec.scale = 0.5;
+    clarendon = new_state(clarendon.spec);
+    auto point_wise_work = [&] {
+        map_pixels(big, output, [&clarendon](Pixel p) { return clarendon_pixel(p, clarendon); });
+    };
+    tune("tile_size", tile_size, {16, 32, 64, 128, 256}, point_wise_work);
+    int saved_kernel = rotate_kernel;
+    rotate_kernel = ROTATE_BLOCKED;
+    tune("rotate_block", rotate_block, {8, 16, 32, 64, 128}, [&] { output = rotate_90(big, 1); });
+    rotate_kernel = saved_kernel;
+    tune("rotate_kernel", rotate_kernel, {ROTATE_BLOCKED, ROTATE_RECURSIVE}, [&] { output = rotate_90(big, 1); });
+
+    vector<FilterState> states;
+    for (int k = 0; k < TUNE_VARIANTS; k++) {
+        FilterSpec spec = new_spec(8);
+        spec.scale = (k + 1) / (TUNE_VARIANTS + 1.0);
+        states.push_back(new_state(spec));
     }
-    for (int i = 2; i <= rotations; i++) {
-        for (int row = 0; row < rows; row++) {
-            for (int col = 0; col < cols; col++) {
-                if (i % 2 == 0) {
-                    Pixel p = new_image[col][row];
-                    new_image_mirror[(rows - 1) - row][col] = p;
-                } else {
-                    Pixel p = new_image_mirror[row][col];
-                    new_image[(cols - 1) - col][row] = p;
-                }
+    size_t row_bytes = ((size_t)cols * 3 + 3) & ~(size_t)3;
+    tune("band_rows", band_rows, {4, 8, 16, 32, 64, 128}, [&] {
+        vector<Pixel> filtered(cols);
+        vector<unsigned char> band_bytes(band_rows * row_bytes);
+        for (int top = 0; top < rows; top += band_rows) {
+            for (int k = 0; k < TUNE_VARIANTS; k++) {
+                encode_band(big, states[k], top, min(top + band_rows, rows), row_bytes, filtered, band_bytes.data());
             }
         }
+    });
+
+    vector<int> thread_candidates;
+    int cores = thread::hardware_concurrency();
+    for (int n = 1; n < cores; n = n * 2) {
+        thread_candidates.push_back(n);
     }
-    if (rotations % 2 == 0) {
-        return new_image_mirror;
-    } else {
-        return new_image;
+    thread_candidates.push_back(max(cores, 1));
+    tune("threads", thread_count, thread_candidates, point_wise_work);
+    // Choosing the core count itself is left as 0, so the profile still fits a host with more cores
+    if (thread_count == cores) {
+        thread_count = 0;
+    }
+
+    // The store kernels, for outputs as large as this one: cached or streaming stores
+    int streaming = streaming_store_bytes != numeric_limits<size_t>::max();
+    tune("streaming_stores", streaming, {0, 1}, [&] {
+        streaming_store_bytes = streaming ? 0 : numeric_limits<size_t>::max();
+        point_wise_work();
+    });
+    streaming_store_bytes = streaming ? 32 << 20 : numeric_limits<size_t>::max();
+
+    if (!save_profile(filename)) {
+        cerr << "Could not write " << filename << endl;
+        return 1;
     }
+    engine_profile = filename;
+    cout << "Engine: " << engine_settings() << endl;
+    return 0;
 }
 
 //**************************************************************************************************//
-//                               Image Processing functions                                         //
+//                                       Command Line                                               //
 //**************************************************************************************************//
 
-Image process_1(const Image& image) {
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            int red, blue, green;
-            Pixel p = image[row][col];
-            tie(red, blue, green) = rbg_pixel(p);
-            // find distance to center
-            double dist = sqrt(pow((col - (cols/2.0)), 2.0) + pow(row - (rows/2.0), 2.0));
-            double scale_factor = (rows - dist)/ rows;
-
-            int n_red, n_blue, n_green;
-            n_red = red * scale_factor;
-            n_blue = blue * scale_factor;
-            n_green = green * scale_factor;
+void print_usage() {
+    cout << "Usage:" << endl;
+    cout << "  main                      interactive menu" << endl;
+    cout << "  main hash FILE.bmp...     print the pixel content hash of each image" << endl;
+    cout << "  main to-tiles IN.bmp OUT.tiles [TILE_SIZE]" << endl;
+    cout << "                            convert a BMP image to a tiled file" << endl;
+    cout << "  main from-tiles IN.tiles OUT.bmp" << endl;
+    cout << "                            convert a tiled file to a BMP image" << endl;
+    cout << "  main crop IN.tiles OUT.bmp TOP LEFT ROWS COLS" << endl;
+    cout << "                            read one region of a tiled file" << endl;
+    cout << "  main rotate-tiles IN.tiles OUT.tiles ROTATIONS" << endl;
+    cout << "                            rotate a tiled file by multiples of 90 degrees, tile by tile" << endl;
+    cout << "  main gallery IN.bmp OUT_PREFIX [FILTER...]" << endl;
+    cout << "                            save several filters of one image, all ten by default;" << endl;
+    cout << "                            FILTER is NAME[:VALUE] such as lighten:0.5 or enlarge:2x3" << endl;
+    cout << "                            (enlarge factors multiply to at most 4096)" << endl;
+    cout << "  main sweep [--sheet SHEET.bmp] IN.bmp OUT_PREFIX SWEEP..." << endl;
+    cout << "                            render variants in one pass over the image; SWEEP is a range" << endl;
+    cout << "                            such as lighten:0.1..0.9:0.05 or a point-wise FILTER" << endl;
+    cout << "  main sheet [--cell PIXELS] [--columns N] [--chain CHAIN] [--stream] OUT.bmp IN.bmp..." << endl;
+    cout << "                            save a contact sheet of downscaled, filtered images" << endl;
+    cout << "  main batch [--journal FILE] [--budget MS] [--report FILE] OUT_DIR FILTER[,FILTER...] FILE.bmp..." << endl;
+    cout << "                            apply a chain of filters to every file, across images," << endl;
+    cout << "                            within images or both depending on their size; with a" << endl;
+    cout << "                            journal, a restarted run skips the files already done;" << endl;
+    cout << "                            latency percentiles per image and stage are printed and" << endl;
+    cout << "                            saved as JSON to the report, listing images over the budget" << endl;
+    cout << "  main batch --shard-dir DIR [--chunk N] [--lease SECONDS] OUT_DIR FILTER[,...] FILE.bmp..." << endl;
+    cout << "                            share a batch between processes started with the same files," << endl;
+    cout << "                            each leasing chunks of N files through lease files in DIR" << endl;
+    cout << "  main batch --prefork N [--timeout SECONDS] OUT_DIR FILTER[,FILTER...] FILE.bmp..." << endl;
+    cout << "                            filter in N worker processes, so a crash only loses its file;" << endl;
+    cout << "                            a worker stuck on a file for SECONDS (60) is killed and replaced" << endl;
+    cout << "  main watch [--metrics FILE] OUT_DIR FILTER[,FILTER...] DIR..." << endl;
+    cout << "                            filter each BMP file written or moved into DIR until stopped," << endl;
+    cout << "                            saving Prometheus metrics to FILE every second" << endl;
+    cout << "  main serve PORT [WORKERS]" << endl;
+    cout << "                            serve POST /filter?chain=FILTER[,FILTER...] on 127.0.0.1," << endl;
+    cout << "                            filtering a BMP or binary PPM body; metrics on GET /metrics;" << endl;
+    cout << "                            add &priority=bulk to yield to interactive requests and" << endl;
+    cout << "                            &deadline_ms=N to abandon a request after N ms" << endl;
+    cout << "  main load PORT FILE CHAIN [CONNECTIONS] [REQUESTS]" << endl;
+    cout << "                            send FILE to a local server and report requests/sec and latency" << endl;
+    cout << "  main gen OUT_DIR KIND:SIZE[:SEED]..." << endl;
+    cout << "                            write synthetic BMP images, the same for the same arguments;" << endl;
+    cout << "                            KIND is gradient, noise, spectrum, border, few, many or all," << endl;
+    cout << "                            SIZE is WIDTHxHEIGHT or megapixels or gigapixels such as 16MP," << endl;
+    cout << "                            up to the 4 GB BMP limit, about 1.4GP" << endl;
+    cout << "  main autotune [--profile FILE] [FILE.bmp]" << endl;
+    cout << "                            time tile, block and band sizes, threads, rotation and store kernels" << endl;
+    cout << "                            on this host and save the fastest to the profile, read at" << endl;
+    cout << "                            startup from $HORN_PROFILE or ~/.horn.profile" << endl;
+    cout << "  main bench SUITE [FILE.bmp]" << endl;
+    cout << "                            run a benchmark suite (lz, stores, rotate, transpose) on" << endl;
+    cout << "                            FILE.bmp or sample.bmp; FILE may be gen:KIND:SIZE[:SEED]" << endl;
+    cout << "                            to generate the image, as may autotune's" << endl;
+}
 
-            new_image[row][col] = new_pixel(n_red, n_blue, n_green);
+/**
+ * Prints the pixel content hash of each image, computed while the image is decoded
+ * @param files The BMP files to hash
+ * @return the process exit code
+ */
+int command_hash(const vector<string>& files) {
+    Image image;
+    vector<unsigned char> buffer;
+    int status = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        uint64_t hash;
+        if (!read_image(files[i], image, buffer, &hash)) {
+            cerr << files[i] << ": not a valid BMP image" << endl;
+            status = 1;
+            continue;
         }
+        cout << hash_to_string(hash) << "  " << files[i] << endl;
     }
-    return new_image;
+    return status;
 }
 
-Image process_2(const Image& image) {
-    int rows, cols;
-    tie(rows, cols) = size_image(image);
-    double scale_factor = get_scale();
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            int red, green, blue;
-            Pixel p = image[row][col];
-            tie(red, blue, green) = rbg_pixel(p);
-            int avg = (red + blue + green) / 3;
-            int n_red, n_blue, n_green;
-            // if pixel is light, make lighter
-            if (avg >= 170) {
-                n_red = (255 - (255 - red)*scale_factor);
-                n_blue = (255 - (255 - blue)*scale_factor);
-                n_green = (255 - (255 - green)*scale_factor);
-            } else if (avg < 90) {
-                n_red = red * scale_factor;
-                n_blue = blue * scale_factor;
-                n_green = green * scale_factor;
-            } else {
-                n_red = red;
-                n_blue = blue;
-                n_green = green;
-            }
-            new_image[row][col] = new_pixel(n_red, n_blue, n_green);
-        }
+int command_to_tiles(const vector<string>& args) {
+    Image image = read_image(args[0]);
+    if (image.empty()) {
+        cerr << args[0] << ": not a valid BMP image" << endl;
+        return 1;
     }
-    return new_image;
+    int side = args.size() > 2 ? atoi(args[2].c_str()) : tile_size;
+    if (side < 1 || !write_tiled(args[1], image, side, true)) {
+        cerr << "Could not write " << args[1] << endl;
+        return 1;
+    }
+    return 0;
 }
 
-Image process_3(const Image& image) {
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            int red, green, blue;
-            Pixel p = image[row][col];
-            tie(red, blue, green) = rbg_pixel(p);
-            int avg = (red + blue + green) / 3;
-            new_image[row][col] = new_pixel(avg, avg, avg);
-        }
+int command_from_tiles(const vector<string>& args) {
+    Image image;
+    if (!read_tiled(args[0], image)) {
+        cerr << args[0] << ": not a valid tiled file" << endl;
+        return 1;
     }
-    return new_image;
+    return write_image(args[1], image) ? 0 : 1;
 }
 
-Image process_4(const Image& image) {
-    return rotate_90(image, 1);
+int command_crop(const vector<string>& args) {
+    TiledFile tiled;
+    if (!open_tiled(args[0], tiled)) {
+        cerr << args[0] << ": not a valid tiled file" << endl;
+        return 1;
+    }
+    Image region;
+    bool ok = read_tiled_region(tiled, atoi(args[2].c_str()), atoi(args[3].c_str()),
+                                atoi(args[4].c_str()), atoi(args[5].c_str()), region);
+    close_tiled(tiled);
+    if (!ok) {
+        cerr << "Region is outside the image" << endl;
+        return 1;
+    }
+    return write_image(args[1], region) ? 0 : 1;
 }
 
-Image process_5(const Image& image) {
-    int num = 0;
-    while (num < 1 || cin.fail()) {
-        cin.clear();
-        cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        cout << "Enter number of 90 degree rotations: ";
-        cin >> num;
-        if (num < 1 || cin.fail()) {
-            cout << "Invalid input! Please enter an integer > 0" << endl;
-        }
+int command_rotate_tiles(const vector<string>& args) {
+    int rotations = atoi(args[2].c_str());
+    if (rotations < 0 || !rotate_tiled(args[0], args[1], rotations, true)) {
+        cerr << "Could not rotate " << args[0] << endl;
+        return 1;
     }
-    return rotate_90(image, num);
+    return 0;
 }
 
-Image process_6(const Image& image) {
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    int x = 0;
-    while (x < 1 || cin.fail()) {
-        cin.clear();
-        cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        cout << "Enter X scale: ";
-        cin >> x;
-        cout << endl;
-        if (x < 1 || cin.fail()) {
-            cout << "Invalid input! Please enter an integer > 0" << endl;
-        }
+int command_gallery(const vector<string>& args) {
+    vector<FilterSpec> specs;
+    if (!parse_filter_specs(vector<string>(args.begin() + 2, args.end()), specs)) {
+        return 1;
     }
-    int y = 0;
-    while (y < 1 || cin.fail()) {
-        cin.clear();
-        cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        cout << "Enter Y scale: ";
-        cin >> y;
-        cout << endl;
-        if (y < 1 || cin.fail()) {
-            cout << "Invalid input! Please enter an integer > 0" << endl;
+    if (specs.empty()) {
+        for (int i = 0; i < 10; i++) {
+            specs.push_back(new_spec(i + 1));
+            parse_filter_spec(spec_names[i], specs.back());
         }
     }
-    Image new_image(rows * y, vector<Pixel>(cols * x));
-    for (int row = 0; row < y * rows; row++) {
-        for (int col = 0; col < x * cols; col ++) {
-            Pixel p = image[row/y][col/x];
-            new_image[row][col] = p;
+    bool ok = run_gallery(args[0], args[1], specs);
+    background_writer.finish();
+    return ok ? 0 : 1;
+}
+
+int command_batch(vector<string> args) {
+    BatchOptions options = new_batch_options();
+    while (args.size() > 2 && args[0].compare(0, 2, "--") == 0) {
+        if (args[0] == "--journal") {
+            options.journal = args[1];
+        } else if (args[0] == "--prefork") {
+            options.prefork = atoi(args[1].c_str());
+        } else if (args[0] == "--shard-dir") {
+            options.shard_dir = args[1];
+        } else if (args[0] == "--chunk") {
+            options.chunk_size = atoi(args[1].c_str());
+        } else if (args[0] == "--lease") {
+            options.lease_seconds = atoi(args[1].c_str());
+        } else if (args[0] == "--timeout") {
+            options.job_seconds = atoi(args[1].c_str());
+        } else if (args[0] == "--budget") {
+            options.budget_ms = atof(args[1].c_str());
+        } else if (args[0] == "--report") {
+            options.report = args[1];
+        } else {
+            print_usage();
+            return 1;
         }
+        args.erase(args.begin(), args.begin() + 2);
     }
-    return new_image;
+    vector<FilterSpec> chain;
+    if (args.size() < 3 || !parse_filter_chain(args[1], chain)) {
+        return 1;
+    }
+    if (options.chunk_size < 1 || options.lease_seconds < 1 || options.job_seconds < 1) {
+        print_usage();
+        return 1;
+    }
+    if (options.prefork > 0 && (!options.shard_dir.empty() || !options.journal.empty())) {
+        cerr << "Prefork runs take no journal or shard directory" << endl;
+        return 1;
+    }
+    if ((options.prefork > 0 || !options.shard_dir.empty()) && (options.budget_ms > 0 || !options.report.empty())) {
+        cerr << "Latency budgets and reports are for runs in one process with threads" << endl;
+        return 1;
+    }
+    if (!options.shard_dir.empty() && !options.journal.empty()) {
+        cerr << "Sharded runs record finished chunks in the shard directory and take no journal" << endl;
+        return 1;
+    }
+    options.chain_text = args[1];
+    vector<string> files(args.begin() + 2, args.end());
+    if (!options.shard_dir.empty()) {
+        return run_sharded(files, args[0], chain, options) == 0 ? 0 : 1;
+    }
+    if (options.prefork > 0) {
+        return run_prefork(files, args[0], chain, options.prefork, options.job_seconds) == 0 ? 0 : 1;
+    }
+    return run_batch(files, args[0], chain, options) == 0 ? 0 : 1;
 }
 
-Image process_7(const Image& image) {
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            Pixel p = image[row][col];
-            int red, blue, green;
-            tie(red, blue, green) = rbg_pixel(p);
-            double avg = (red + blue + green) / 3.0;
-            int n_red, n_blue, n_green;
-            if (avg >= 127.5) {
-                n_red = 255;
-                n_blue = 255;
-                n_green = 255;
-            } else {
-                n_red = 0;
-                n_blue = 0;
-                n_green = 0;
-            }
-            new_image[row][col] = new_pixel(n_red, n_blue, n_green);
-        }
+int command_watch(vector<string> args) {
+    string metrics_file;
+    if (args[0] == "--metrics" && args.size() >= 5) {
+        metrics_file = args[1];
+        args.erase(args.begin(), args.begin() + 2);
     }
-    return new_image;
+    vector<FilterSpec> chain;
+    if (!parse_filter_chain(args[1], chain)) {
+        return 1;
+    }
+    return run_watch(vector<string>(args.begin() + 2, args.end()), args[0], chain, metrics_file);
 }
 
-Image process_8(const Image& image) {
-    double scale = get_scale();
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            Pixel p = image[row][col];
-            int red, blue, green;
-            tie(red,blue,green) = rbg_pixel(p);
-            int n_red, n_blue, n_green;
-            n_red = 255 - ((255 - red) * scale);
-            n_blue = 255 - ((255 - blue) * scale);
-            n_green = 255 - ((255 - green) * scale);
-            new_image[row][col] = new_pixel(n_red, n_blue, n_green);
-        }
+int command_serve(const vector<string>& args) {
+    int port = atoi(args[0].c_str());
+    int workers = args.size() > 1 ? atoi(args[1].c_str()) : worker_count();
+    if (port < 1 || port > 65535 || workers < 1) {
+        print_usage();
+        return 1;
     }
-    return new_image;
+    return run_server(port, workers);
 }
 
-Image process_9(const Image& image) {
-    double scale = get_scale();
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            Pixel p = image[row][col];
-            int red, blue, green;
-            tie(red,blue,green) = rbg_pixel(p);
-            int n_red, n_blue, n_green;
-            n_red = red * scale;
-            n_blue = blue * scale;
-            n_green = green * scale;
-            new_image[row][col] = new_pixel(n_red, n_blue, n_green);
-        }
+int command_load(const vector<string>& args) {
+    int port = atoi(args[0].c_str());
+    int clients = args.size() > 3 ? atoi(args[3].c_str()) : 4;
+    int total = args.size() > 4 ? atoi(args[4].c_str()) : 1000;
+    if (port < 1 || port > 65535 || clients < 1 || total < 1) {
+        print_usage();
+        return 1;
     }
-    return new_image;
+    return run_load(port, args[1], args[2], clients, total);
 }
 
-Image process_10(const Image& image) {
-    int rows, cols;
-    tie(rows,cols) = size_image(image);
-    Image new_image(rows, vector<Pixel> (cols));
-    for (int row = 0; row < rows; row++) {
-        for (int col = 0; col < cols; col++) {
-            Pixel p = image[row][col];
-            int red, blue, green;
-            tie(red, blue, green) = rbg_pixel(p);
-            int mx = max(red, blue);
-            mx = max(mx, green);
-            int sum = red + blue + green;
-            int n_red, n_blue, n_green;
-            if (sum >= 550) {
-                n_red = 255;
-                n_blue = 255;
-                n_green = 255;
-            } else if (sum <= 150) {
-                n_red = 0;
-                n_blue = 0;
-                n_green = 0;
-            } else if (mx == red) {
-                n_red = 255;
-                n_blue = 0;
-                n_green = 0;
-            } else if (mx == green) {
-                n_red = 0;
-                n_blue = 0;
-                n_green = 255;
-            } else {
-                n_red = 0;
-                n_blue = 255;
-                n_green = 0;
+int command_sheet(vector<string> args) {
+    int cell_side = SHEET_CELL;
+    int columns = 0;
+    bool stream = false;
+    vector<FilterSpec> chain;
+    while (args.size() > 2 && args[0].compare(0, 2, "--") == 0) {
+        if (args[0] == "--stream") {
+            stream = true;
+            args.erase(args.begin());
+            continue;
+        }
+        if (args[0] == "--cell") {
+            cell_side = atoi(args[1].c_str());
+        } else if (args[0] == "--columns") {
+            columns = atoi(args[1].c_str());
+        } else if (args[0] == "--chain") {
+            if (!parse_filter_chain(args[1], chain)) {
+                return 1;
             }
-            new_image[row][col] = new_pixel(n_red, n_blue, n_green);
+        } else {
+            print_usage();
+            return 1;
         }
+        args.erase(args.begin(), args.begin() + 2);
     }
-    return new_image;
-}
-
-//**************************************************************************************************//
-//                                       UI functions                                               //
-//**************************************************************************************************//
-
-string get_input_filename() {
-    cout << "Enter input BMP filename: ";
-    string input;
-    cin >> input;
-    return input;
-}
-
-string get_output_filename() {
-    cout << "Enter output BMP filename: ";
-    string input;
-    cin >> input;
-    return input;
-}
-
-
-void print_menu(string& current_file) {
-    cout << endl;
-    cout << "IMAGE PROCESSING MENU" << endl;
-    cout << " 1) Vignette" << endl;
-    cout << " 2) Clarendon" << endl;
-    cout << " 3) Grayscale" << endl;
-    cout << " 4) Rotate 90 degrees" << endl;
-    cout << " 5) Rotate multiple 90 degrees" << endl;
-    cout << " 6) Enlarge" << endl;
-    cout << " 7) High contrast" << endl;
-    cout << " 8) Lighten" << endl;
-    cout << " 9) Darken" << endl;
-    cout << "10) Black, white, red, green, blue" << endl;
-    cout << "11) Change image (current: " << current_file << ")" << endl;
-    cout << endl;
-    cout << "Enter menu selection (Q/q to quit): ";
+    if (args.size() < 2 || cell_side < 1 || columns < 0) {
+        print_usage();
+        return 1;
+    }
+    vector<string> files(args.begin() + 1, args.end());
+    return run_contact_sheet(files, args[0], chain, cell_side, columns, stream) ? 0 : 1;
 }
 
-//**************************************************************************************************//
-//                                       Handler Helpers                                            //
-//**************************************************************************************************//
-
-Image get_image(string filename, string filter_name) {
-    cout << endl;
-    cout << filter_name <<" selected" << endl;
-    return read_image(filename);
+int command_autotune(vector<string> args) {
+    string filename = profile_path();
+    if (args.size() >= 2 && args[0] == "--profile") {
+        filename = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    }
+    if (filename.empty()) {
+        cerr << "Give a profile with --profile or HORN_PROFILE, as there is no home directory" << endl;
+        return 1;
+    }
+    Image image = benchmark_image(args.empty() ? "sample.bmp" : args[0]);
+    if (image.empty()) {
+        cerr << "Tuning needs a valid BMP image" << endl;
+        return 1;
+    }
+    return run_autotune(image, filename);
 }
 
-void respond(string filter_name, Image& new_image) {
-    string output_file = get_output_filename();
-    write_image(output_file, new_image);
-    cout << "Successfully applied " << filter_name << "!" << endl;
+int command_gen(const vector<string>& args) {
+    vector<CorpusSpec> specs;
+    for (size_t i = 1; i < args.size(); i++) {
+        // all:SIZE is every kind at that size
+        bool all = args[i].compare(0, 4, "all:") == 0;
+        for (int kind = 0; kind < (all ? CORPUS_KINDS : 1); kind++) {
+            CorpusSpec spec;
+            string text = all ? corpus_kind_names[kind] + args[i].substr(3) : args[i];
+            if (!parse_corpus_spec(text, spec)) {
+                cerr << "Bad image " << args[i] << endl;
+                return 1;
+            }
+            specs.push_back(spec);
+        }
+    }
+    if (mkdir(args[0].c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Could not create " << args[0] << endl;
+        return 1;
+    }
+    return run_gen(args[0], specs) == 0 ? 0 : 1;
 }
 
-//**************************************************************************************************//
-//                                          Handler                                                 //
-//**************************************************************************************************//
-
-
-/**
- * Perform the input process on the input filename and use the filter name in the output
- * @param filename The BMP file name to save the image to
- * @param filter_name The common name for the output of the process, such as 'clarendon'
- * @param *process A pointer to a function for processing the image and returning the new image
- * @void
- */
-void execute(string filename, string filter_name, Process process) {
-    string upper = filter_name;
-    upper[0] = std::toupper(filter_name[0]);
-    Image image = get_image(filename, upper);
-    Image new_image = process(image);
-    respond(filter_name, new_image);
+int command_sweep(vector<string> args) {
+    string sheet;
+    if (args[0] == "--sheet" && args.size() >= 5) {
+        sheet = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+    }
+    vector<FilterSpec> specs;
+    for (size_t i = 2; i < args.size(); i++) {
+        if (!parse_sweep(args[i], specs)) {
+            cerr << "Bad sweep " << args[i] << endl;
+            return 1;
+        }
+    }
+    if (specs.size() > (size_t)SWEEP_MAX_VARIANTS) {
+        cerr << "A sweep makes at most " << SWEEP_MAX_VARIANTS << " variants" << endl;
+        return 1;
+    }
+    return run_sweep(args[0], args[1], specs, sheet) ? 0 : 1;
 }
 
-//**************************************************************************************************//
-//                                         "Router"                                                 //
-//**************************************************************************************************//
-
-const Process proc_arr[10] = {
-        &process_1,
-        &process_2,
-        &process_3,
-        &process_4,
-        &process_5,
-        &process_6,
-        &process_7,
-        &process_8,
-        &process_9,
-        &process_10
-};
-const string filter_arr[10] = {
-        "vignette",
-        "clarendon",
-        "greyscale",
-        "rotate 90 degrees",
-        "rotate multiple 90 degrees",
-        "enlarge",
-        "high contrast",
-        "lighten",
-        "darken",
-        "black, white, red, green, blue"
-};
-
-string map_selection(int s, string current_file) {
-    if (s == 11) {
-        cout << "Change image selected" << endl;
-        return get_input_filename();
+int run_command(int argc, char* argv[]) {
+    string command = argv[1];
+    vector<string> args(argv + 2, argv + argc);
+    if (command == "hash" && !args.empty()) {
+        return command_hash(args);
     }
-    execute(current_file, filter_arr[s-1], proc_arr[s-1]);
-    return current_file;
+    if (command == "to-tiles" && args.size() >= 2) {
+        return command_to_tiles(args);
+    }
+    if (command == "from-tiles" && args.size() == 2) {
+        return command_from_tiles(args);
+    }
+    if (command == "crop" && args.size() == 6) {
+        return command_crop(args);
+    }
+    if (command == "rotate-tiles" && args.size() == 3) {
+        return command_rotate_tiles(args);
+    }
+    if (command == "gallery" && args.size() >= 2) {
+        return command_gallery(args);
+    }
+    if (command == "gen" && args.size() >= 2) {
+        return command_gen(args);
+    }
+    if (command == "autotune") {
+        return command_autotune(args);
+    }
+    if (command == "sheet" && args.size() >= 2) {
+        return command_sheet(args);
+    }
+    if (command == "sweep" && args.size() >= 3) {
+        return command_sweep(args);
+    }
+    if (command == "batch" && args.size() >= 3) {
+        return command_batch(args);
+    }
+    if (command == "watch" && args.size() >= 3) {
+        return command_watch(args);
+    }
+    if (command == "serve" && !args.empty()) {
+        return command_serve(args);
+    }
+    if (command == "load" && args.size() >= 3) {
+        return command_load(args);
+    }
+    if (command == "bench" && !args.empty()) {
+        return command_bench(args);
+    }
+    print_usage();
+    return 1;
 }
 
 //**************************************************************************************************//
 //                                       Main                                                       //
 //**************************************************************************************************//
 
-int main()
+int main(int argc, char* argv[])
 {
+    string profile = profile_path();
+    if (load_profile(profile)) {
+        cerr << "Engine settings from " << profile << endl;
+    }
+    if (argc > 1) {
+        return run_command(argc, argv);
+    }
+
     cout << "CSPB 1300 Image Processing Application" << endl;
     string filename = get_input_filename();
 
@@ -644,6 +7781,7 @@ int main()
     while (input != "Q" && input != "q") {
         int sel = 0;
         while (sel == 0) {
+            background_writer.report();
             print_menu(filename);
             cin >> input;
             if (input == "Q" || input == "q") {
@@ -654,12 +7792,13 @@ int main()
         if (input == "Q" || input == "q") {
             break;
         }
-        if (sel > 11) {
+        if (sel > 13) {
             continue;
         }
         filename = map_selection(sel, filename);
     }
 
-
+    // Finish any images still being saved before exiting
+    background_writer.finish();
     return 0;
 }
\ No newline at end of file